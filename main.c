@@ -6,18 +6,119 @@
 //
 
 #include <SDL2/SDL.h>
+#include <SDL2/SDL_opengl.h>
+#include <ctype.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <math.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 
 // Constant macros
 #define STACK_SIZE 16
+#define MAX_BLOCK_LENGTH 32
+#define BLOCK_PAGE_SIZE (MAX_BLOCK_LENGTH * 2)
+#define DISPLAY_WORDS (64 * 2)
+#define REPORT_SIZE 256
+#define LANES 16
+#define FRAME_RATE 60
+#define MAX_CATCH_UP_FRAMES 4
+#define FRESH_FRAME 4
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_PAGE_SIZE 64
+#define SNAPSHOT_PAGES (4096 / SNAPSHOT_PAGE_SIZE)
+#define SNAPSHOT_HEADER_SIZE 1108
+#define MAX_SNAPSHOT_SIZE (SNAPSHOT_HEADER_SIZE + 4096)
+#define MAX_ROM_SIZE (4096 - 0x200)
+#define PACK_VERSION 1
+#define PACK_HEADER_SIZE 12
+#define PACK_ENTRY_SIZE 64
+#define PACK_NAME_SIZE 48
+
+// Behaviours that differ between CHIP-8 variants
+#define QUIRK_SHIFT_VY 0x01 // 8XY6 and 8XYE shift VY into VX
+#define QUIRK_JUMP_VX 0x02  // BNNN is BXNN and jumps to XNN + VX
+#define QUIRK_INDEX 0x04    // FX55 and FX65 move the index past VX
+#define QUIRK_INDEX_X 0x08  // FX55 and FX65 move the index onto VX
+#define QUIRK_VF_RESET 0x10 // 8XY1, 8XY2 and 8XY3 clear VF
+#define QUIRK_DISPLAY_WAIT 0x20 // DXYN waits for the next frame
+#define QUIRK_SPRITE16 0x40     // DXY0 draws 16x16 at low resolution too
+#define REWIND_FRAMES (FRAME_RATE * 10)
+#define REWIND_PAGES 1024
+#define REWIND_ROWS 16384
+#define REWIND_KEY (1 << 16)
+#define FAST_FORWARD_KEY (1 << 17)
+#define INPUT_LOG_VERSION 2
+#define INPUT_LOG_HEADER_SIZE 14
+#define MAX_FRAME_CHANGES 32
+#define KEY_QUEUE_SIZE 256
+#define SAMPLE_RATE 48000
+#define SAMPLES_PER_FRAME (SAMPLE_RATE / FRAME_RATE)
+#define AUDIO_BUFFER_SAMPLES 256
+#define AUDIO_RING_SIZE 4096
+#define AUDIO_MAX_QUEUED (SAMPLES_PER_FRAME * 2)
+#define BEEP_FREQUENCY 440
+#define BEEP_VOLUME 3000
+
+struct Chip8;
+struct Instruction;
+
+typedef void (*Handler)(struct Chip8 *, const struct Instruction *);
+
+// An instruction decoded ahead of time with its operands already extracted
+typedef struct Instruction {
+  Handler execute; // Handler for the opcode, NULL if not decoded yet
+  uint16_t opcode;
+  uint16_t NNN;
+  uint8_t X;
+  uint8_t Y;
+  uint8_t N;
+  uint8_t NN;
+} Instruction;
+
+// Why a machine stopped. The machine is left on the faulting instruction and
+// the host decides what to do, so one bad ROM never takes the process down
+typedef enum TrapCode {
+  TRAP_NONE,
+  TRAP_UNRECOGNISED_OPCODE,
+  TRAP_STACK_OVERFLOW,
+} TrapCode;
+
+typedef struct Trap {
+  TrapCode code;
+  uint16_t pc; // Address of the instruction that trapped
+  uint16_t opcode;
+} Trap;
+
+const char *const trapNames[] = {"none", "unrecognised opcode",
+                                 "stack overflow"};
+
+// Why runCycles returned
+typedef enum StopReason {
+  STOP_BUDGET,    // Ran every cycle it was given
+  STOP_IDLE,      // Stuck in a loop that can't end until the next frame
+  STOP_KEY_WAIT,  // FX0A is waiting for a key to be pressed
+  STOP_DRAW_WAIT, // Drew a sprite and is waiting for the next frame
+  STOP_TRAP,      // Stopped on a bad instruction, see the machine's trap
+} StopReason;
+
+#ifdef CHIP8_PROFILE
+// Execution counts gathered when built with -DCHIP8_PROFILE
+typedef struct Profile {
+  uint64_t opcodes[0x10000]; // Executions of each opcode
+  uint64_t addresses[4096];  // Executions at each address
+  uint64_t spins[4096];      // Executions that left pc where it was
+} Profile;
+#endif
 
 typedef struct Chip8 {
   uint8_t memory[4096];       // 4kB RAM
-  bool display[64 * 32];      // Pixel array for display
+  // Display rows with the leftmost pixel in the top bit, see displayWords
+  uint64_t display[DISPLAY_WORDS];
   uint8_t keypad[16];         // 16 digit keypad
   uint8_t V[16];              // Registers 0-15
   uint16_t stack[STACK_SIZE]; // Stack of addresses for returning from calls
@@ -27,15 +128,171 @@ typedef struct Chip8 {
   uint16_t pc;                // Program counter
   uint16_t index;             // Index register
   uint16_t opcode;            // Current instruction
+  bool displayDirty;          // Display has changed since it was last drawn
+  uint32_t rng;               // Random number generator state
+  long budget;                // Cycles left to run in the current batch
+  uint64_t dirtyPages;        // Memory pages written since last cleared
+  uint64_t dirtyWords[2];     // Display words changed since last cleared
+  Instruction decoded[4096];  // Decoded instruction at each address
+  uint8_t blockLength[4096];  // Instructions in the block at each address
+  uint64_t blockPages;        // Pages that have had blocks compiled in them
+  uint8_t quirks;             // QUIRK_ flags the instructions are decoded with
+  Trap trap;                  // Set when the cpu stops on a bad instruction
+  StopReason stop;            // Why the last batch ended
+  uint8_t clockPhase;         // Cycles carried between frames, in 60ths
+  bool hires;                 // Using the 128x64 SUPER-CHIP display
+  int clockSpeed;             // Cycles run per second
+  bool blockCache;            // Run through the block cache
+#ifdef CHIP8_PROFILE
+  Profile profile;
+#endif
+#ifdef CHIP8_AOT
+  bool compiled;          // Running the ROM this build was compiled from
+  uint64_t modifiedPages; // Memory pages written since the ROM was loaded
+#endif
 } Chip8;
 
+#ifdef CHIP8_AOT
+// Provided by the file --compile generates, which includes this one
+extern const uint8_t compiledROM[];
+extern const size_t compiledROMSize;
+extern const uint8_t compiledQuirks;
+bool runCompiledBlock(Chip8 *chip8);
+#endif
+
 // Globals
 SDL_Window *window = NULL;
 SDL_Renderer *renderer = NULL;
+SDL_GLContext glContext = NULL;
 SDL_Color background = {0, 0, 0, 255};
 SDL_Color foreground = {255, 255, 255, 255};
 int scale = 10;
-int clockSpeed = 500;
+bool headless = false;
+long frameBudget = 600;
+long cycleBudget = 0;
+int jobCount = 0;
+bool useLanes = false;
+bool vsync = false;
+bool frameStats = false;
+bool bench = false;
+char *loadStatePath = NULL;
+char *saveStatePath = NULL;
+bool rewindEnabled = false;
+char *recordPath = NULL;
+char *replayPath = NULL;
+char *packPath = NULL;
+char *corpusPath = NULL;
+bool muted = false;
+bool useShader = false;
+float persistence = 0;
+int fastForward = 4;
+bool streaming = false;
+bool debugging = false;
+bool analyzing = false;
+bool conformance = false;
+char *compilePath = NULL;
+
+typedef struct QuirkProfile {
+  const char *name;
+  uint8_t quirks;
+} QuirkProfile;
+
+// Selected by name with --quirks, or by index from a ROM pack where 0 means
+// whatever was given on the command line
+const QuirkProfile quirkProfiles[] = {
+    {"none", 0},
+    {"chip8",
+     QUIRK_SHIFT_VY | QUIRK_INDEX | QUIRK_VF_RESET | QUIRK_DISPLAY_WAIT},
+    {"chip48", QUIRK_JUMP_VX | QUIRK_INDEX_X},
+    {"schip", QUIRK_JUMP_VX | QUIRK_SPRITE16},
+    {"xochip", QUIRK_SHIFT_VY | QUIRK_INDEX | QUIRK_SPRITE16},
+};
+
+#define QUIRK_PROFILE_COUNT (sizeof(quirkProfiles) / sizeof(quirkProfiles[0]))
+
+// How new machines are set up, filled in from the command line. Each machine
+// keeps its own copy so machines with different settings can run together
+typedef struct Settings {
+  int clockSpeed;
+  bool blockCache;
+  uint32_t seed;
+  int quirkProfile;
+} Settings;
+
+Settings settings = {.clockSpeed = 500};
+
+int findQuirkProfile(const char *name) {
+  for (size_t i = 0; i < QUIRK_PROFILE_COUNT; i++) {
+    if (strcmp(quirkProfiles[i].name, name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// OpenGL functions used by the shader renderer, all looked up through SDL so
+// nothing needs linking against a GL library directly
+#define GL_FUNCTIONS(X)                                                        \
+  X(void, ActiveTexture, (GLenum))                                             \
+  X(void, AttachShader, (GLuint, GLuint))                                      \
+  X(void, BindFramebuffer, (GLenum, GLuint))                                   \
+  X(void, BindTexture, (GLenum, GLuint))                                       \
+  X(void, BindVertexArray, (GLuint))                                           \
+  X(GLenum, CheckFramebufferStatus, (GLenum))                                  \
+  X(void, Clear, (GLbitfield))                                                 \
+  X(void, ClearColor, (GLfloat, GLfloat, GLfloat, GLfloat))                    \
+  X(void, CompileShader, (GLuint))                                             \
+  X(GLuint, CreateProgram, (void))                                             \
+  X(GLuint, CreateShader, (GLenum))                                            \
+  X(void, DeleteFramebuffers, (GLsizei, const GLuint *))                       \
+  X(void, DeleteProgram, (GLuint))                                             \
+  X(void, DeleteShader, (GLuint))                                              \
+  X(void, DeleteTextures, (GLsizei, const GLuint *))                           \
+  X(void, DeleteVertexArrays, (GLsizei, const GLuint *))                       \
+  X(void, DrawArrays, (GLenum, GLint, GLsizei))                                \
+  X(void, FramebufferTexture2D, (GLenum, GLenum, GLenum, GLuint, GLint))       \
+  X(void, GenFramebuffers, (GLsizei, GLuint *))                                \
+  X(void, GenTextures, (GLsizei, GLuint *))                                    \
+  X(void, GenVertexArrays, (GLsizei, GLuint *))                                \
+  X(void, GetProgramInfoLog, (GLuint, GLsizei, GLsizei *, GLchar *))           \
+  X(void, GetProgramiv, (GLuint, GLenum, GLint *))                             \
+  X(void, GetShaderInfoLog, (GLuint, GLsizei, GLsizei *, GLchar *))            \
+  X(void, GetShaderiv, (GLuint, GLenum, GLint *))                              \
+  X(GLint, GetUniformLocation, (GLuint, const GLchar *))                       \
+  X(void, LinkProgram, (GLuint))                                               \
+  X(void, PixelStorei, (GLenum, GLint))                                        \
+  X(void, ShaderSource,                                                        \
+    (GLuint, GLsizei, const GLchar *const *, const GLint *))                   \
+  X(void, TexImage2D,                                                          \
+    (GLenum, GLint, GLint, GLsizei, GLsizei, GLint, GLenum, GLenum,            \
+     const void *))                                                            \
+  X(void, TexParameteri, (GLenum, GLenum, GLint))                              \
+  X(void, TexSubImage2D,                                                       \
+    (GLenum, GLint, GLint, GLint, GLsizei, GLsizei, GLenum, GLenum,            \
+     const void *))                                                            \
+  X(void, Uniform1f, (GLint, GLfloat))                                         \
+  X(void, Uniform1i, (GLint, GLint))                                           \
+  X(void, Uniform3f, (GLint, GLfloat, GLfloat, GLfloat))                       \
+  X(void, UseProgram, (GLuint))                                                \
+  X(void, Viewport, (GLint, GLint, GLsizei, GLsizei))
+
+#define GL_FUNCTION_POINTER(type, name, parameters)                            \
+  type(APIENTRY *name) parameters;
+struct {
+  GL_FUNCTIONS(GL_FUNCTION_POINTER)
+} gl;
+#undef GL_FUNCTION_POINTER
+
+static bool loadGLFunctions(void) {
+#define GL_LOAD_FUNCTION(type, name, parameters)                               \
+  *(void **)&gl.name = SDL_GL_GetProcAddress("gl" #name);                     \
+  if (gl.name == NULL) {                                                       \
+    return false;                                                              \
+  }
+  GL_FUNCTIONS(GL_LOAD_FUNCTION)
+#undef GL_LOAD_FUNCTION
+  return true;
+}
 
 void initializeSDL(void) {
   if (SDL_Init(SDL_INIT_EVERYTHING) < 0) {
@@ -43,16 +300,38 @@ void initializeSDL(void) {
     exit(EXIT_FAILURE);
   }
 
+  if (useShader) {
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK,
+                        SDL_GL_CONTEXT_PROFILE_CORE);
+    SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+  }
+
   window = SDL_CreateWindow("CHIP-8", SDL_WINDOWPOS_UNDEFINED,
-                            SDL_WINDOWPOS_UNDEFINED, 64 * scale, 32 * scale, 0);
+                            SDL_WINDOWPOS_UNDEFINED, 64 * scale, 32 * scale,
+                            useShader ? SDL_WINDOW_OPENGL : 0);
 
   if (!window) {
     printf("Error : %s", SDL_GetError());
     exit(EXIT_FAILURE);
   }
 
-  renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-  if (!window) {
+  // The shader renderer draws with OpenGL directly instead of an SDL renderer
+  if (useShader) {
+    glContext = SDL_GL_CreateContext(window);
+    if (!glContext || !loadGLFunctions()) {
+      printf("Error : %s", SDL_GetError());
+      exit(EXIT_FAILURE);
+    }
+    SDL_GL_SetSwapInterval(vsync ? 1 : 0);
+    return;
+  }
+
+  renderer = SDL_CreateRenderer(
+      window, -1,
+      SDL_RENDERER_ACCELERATED | (vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
+  if (!renderer) {
     printf("Error : %s", SDL_GetError());
     exit(EXIT_FAILURE);
   }
@@ -65,13 +344,30 @@ void initializeSDL(void) {
 }
 
 void quitSDL(void) {
+  if (glContext) {
+    SDL_GL_DeleteContext(glContext);
+    glContext = NULL;
+  }
   SDL_DestroyWindow(window);
   SDL_DestroyRenderer(renderer);
   SDL_Quit();
   window = NULL;
 }
 
-void setupCHIP(Chip8 *chip8) {
+// Spread a seed out into a generator state, giving each numbered stream of
+// the same seed an unrelated sequence. xorshift gets stuck at zero so that
+// is never returned
+uint32_t mixSeed(uint32_t seed, uint32_t stream) {
+  uint32_t x = seed + (stream + 1) * 0x9E3779B9;
+  x ^= x >> 16;
+  x *= 0x85EBCA6B;
+  x ^= x >> 13;
+  x *= 0xC2B2AE35;
+  x ^= x >> 16;
+  return x ? x : 1;
+}
+
+void setupCHIP(Chip8 *chip8, const Settings *settings) {
   // Clear all data to make sure everything is 0
   memset(chip8, 0, sizeof(*chip8));
 
@@ -99,63 +395,498 @@ void setupCHIP(Chip8 *chip8) {
 
   // Start program counter at 0x200 for compatibility
   chip8->pc = 0x200;
+
+  // Nothing has been drawn yet
+  chip8->displayDirty = true;
+
+  // Every machine gets its own generator so runs with the same seed repeat
+  chip8->rng = mixSeed(settings->seed, 0);
+
+  chip8->quirks = quirkProfiles[settings->quirkProfile].quirks;
+  chip8->clockSpeed = settings->clockSpeed;
+  chip8->blockCache = settings->blockCache;
+}
+
+// Copy a ROM image into memory starting at address 0x200, returns false if
+// it is larger than the available memory
+bool loadROMBuffer(Chip8 *chip8, const uint8_t *rom, size_t size) {
+  if (size > MAX_ROM_SIZE) {
+    return false;
+  }
+  memcpy(&chip8->memory[0x200], rom, size);
+  return true;
 }
 
-void loadROM(char *filePath, Chip8 *chip8) {
+// Read a whole ROM file into buffer, which must hold MAX_ROM_SIZE bytes.
+// Returns the size of the ROM, or -1 with why it couldn't be read in error
+long readROMFile(const char *filePath, uint8_t *buffer, const char **error) {
   FILE *romFile = fopen(filePath, "rb");
   if (romFile == NULL) {
-    fprintf(stderr, "Could not open %s", filePath);
-    exit(EXIT_FAILURE);
+    *error = "could not be opened";
+    return -1;
   }
 
-  fseek(romFile, 0, SEEK_END);
-  size_t romFileSize = ftell(romFile);
-  fseek(romFile, 0, SEEK_SET);
+  // Asking for one byte too many tells us whether the ROM fits
+  size_t romFileSize = fread(buffer, 1, MAX_ROM_SIZE, romFile);
+  bool tooLarge = romFileSize == MAX_ROM_SIZE && fgetc(romFile) != EOF;
+  bool failed = ferror(romFile);
 
-  if (romFileSize > sizeof(chip8->memory) - 512) {
-    fprintf(stderr, "The size of the specified ROM is larger than the "
-                    "available memory");
-    exit(EXIT_FAILURE);
+  fclose(romFile);
+  romFile = NULL;
+  if (failed) {
+    *error = "could not be read";
+    return -1;
+  }
+  if (tooLarge) {
+    *error = "is larger than the available memory";
+    return -1;
+  }
+  return (long)romFileSize;
+}
+
+#ifdef CHIP8_AOT
+// Whether memory holds exactly the ROM this build was compiled from. Zeros
+// past its end don't count, since they were zero when it was compiled too
+bool matchesCompiledROM(const Chip8 *chip8) {
+  if (compiledROMSize > sizeof(chip8->memory) - 0x200 ||
+      memcmp(&chip8->memory[0x200], compiledROM, compiledROMSize) != 0) {
+    return false;
+  }
+  for (size_t i = 0x200 + compiledROMSize; i < sizeof(chip8->memory); i++) {
+    if (chip8->memory[i] != 0) {
+      return false;
+    }
   }
+  return true;
+}
+#endif
 
-  // Read contents of the file into memory starting at address 0x200
-  fread(&chip8->memory[0x200], romFileSize, 1, romFile);
+// Load a ROM file into memory. Returns NULL, or why it couldn't be loaded
+const char *loadROM(char *filePath, Chip8 *chip8) {
+  const char *error;
 
-  fclose(romFile);
-  romFile = NULL;
+  // Read straight into memory starting at address 0x200
+  if (readROMFile(filePath, &chip8->memory[0x200], &error) < 0) {
+    return error;
+  }
+#ifdef CHIP8_AOT
+  chip8->compiled = matchesCompiledROM(chip8);
+  chip8->modifiedPages = 0;
+#endif
+  return NULL;
+}
+
+// End the current batch early
+static inline void stopBatch(Chip8 *chip8, StopReason reason) {
+  chip8->budget = 0;
+  chip8->stop = reason;
+}
+
+// Stop the cpu on the instruction being executed and end the current batch
+void raiseTrap(Chip8 *chip8, TrapCode code) {
+  chip8->pc -= 2;
+  chip8->trap = (Trap){.code = code, .pc = chip8->pc, .opcode = chip8->opcode};
+  stopBatch(chip8, STOP_TRAP);
 }
 
-void unrecognisedOpcode(uint16_t opcode) {
-  fprintf(stderr, "Opcode 0x%04x unrecognised\n", opcode);
-  // while (true) {}
-  quitSDL();
-  exit(EXIT_FAILURE);
+static Uint32 packColor(SDL_Color color) {
+  return (Uint32)color.a << 24 | (Uint32)color.r << 16 | (Uint32)color.g << 8 |
+         color.b;
 }
 
-static void draw(Chip8 *chip8, SDL_Surface *surface) {
-  SDL_LockSurface(surface);
-  SDL_memcpy(surface->pixels, chip8->display, sizeof(chip8->display));
-  SDL_UnlockSurface(surface);
+// Present the current frame, uploading the display first if it has changed.
+// The texture is big enough for the high resolution display and the low
+// resolution one only uses its top left corner
+static void draw(SDL_Texture *texture, const uint64_t *display, bool hires) {
+  SDL_Rect source = {0, 0, hires ? 128 : 64, hires ? 64 : 32};
+
+  if (display != NULL) {
+    Uint32 colors[2] = {packColor(background), packColor(foreground)};
+    void *pixels;
+    int pitch;
+
+    SDL_LockTexture(texture, &source, &pixels, &pitch);
+    // Expand each bit of the display into a pixel
+    for (int y = 0; y < source.h; y++) {
+      Uint32 *texels = (Uint32 *)((uint8_t *)pixels + y * pitch);
+
+      if (hires) {
+        for (int x = 0; x < 128; x++) {
+          uint64_t word = display[y * 2 + x / 64];
+          texels[x] = colors[(word >> (63 - x % 64)) & 1];
+        }
+      } else {
+        uint64_t row = display[y];
+        for (int x = 0; x < 64; x++) {
+          texels[x] = colors[(row >> (63 - x)) & 1];
+        }
+      }
+    }
+    SDL_UnlockTexture(texture);
+  }
 
   SDL_RenderClear(renderer);
-  SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
-  SDL_RenderCopy(renderer, texture, NULL, NULL);
+  SDL_RenderCopy(renderer, texture, &source, NULL);
   SDL_RenderPresent(renderer);
-  SDL_DestroyTexture(texture);
-  texture = NULL;
+}
+
+// A triangle covering the screen, with texture coordinates running from 0 to
+// 1 across the visible part
+static const char *vertexShaderSource =
+    "#version 330 core\n"
+    "out vec2 position;\n"
+    "void main() {\n"
+    "  vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n"
+    "  position = corner;\n"
+    "  gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);\n"
+    "}\n";
+
+// Light each phosphor whose display bit is set, and let the rest fade from
+// how bright they were last frame. There are phosphors for every high
+// resolution pixel, and at low resolution each pixel lights four of them.
+// Display rows are uploaded top first, eight pixels to a byte with the
+// leftmost in the high bit
+static const char *fadeShaderSource =
+    "#version 330 core\n"
+    "uniform usampler2D display;\n"
+    "uniform sampler2D glow;\n"
+    "uniform float persistence;\n"
+    "uniform int shift;\n"
+    "out float brightness;\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  ivec2 source = ivec2(pixel.x, 63 - pixel.y) >> shift;\n"
+    "  uint bits = texelFetch(display, ivec2(source.x >> 3, source.y), 0).r;\n"
+    "  float lit = float((bits >> uint(7 - (source.x & 7))) & 1u);\n"
+    "  float old = texelFetch(glow, pixel, 0).r;\n"
+    "  brightness = max(lit, old * persistence);\n"
+    "}\n";
+
+// Expand the phosphors into the palette at whatever size the viewport is
+static const char *presentShaderSource =
+    "#version 330 core\n"
+    "uniform sampler2D glow;\n"
+    "uniform vec3 background;\n"
+    "uniform vec3 foreground;\n"
+    "in vec2 position;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "  ivec2 size = ivec2(128, 64);\n"
+    "  ivec2 pixel = min(ivec2(position * vec2(size)), size - 1);\n"
+    "  float brightness = texelFetch(glow, pixel, 0).r;\n"
+    "  color = vec4(mix(background, foreground, brightness), 1.0);\n"
+    "}\n";
+
+// Draws with fragment shaders so the only upload each frame is the packed
+// display, 256 bytes, no matter how big the window is
+typedef struct ShaderRenderer {
+  GLuint display;         // Packed display as a 16x64 texture of bytes
+  GLuint glow[2];         // Phosphor brightness, last frame's and this one's
+  GLuint framebuffers[2]; // For drawing into each of the glow textures
+  GLuint vertexArray;     // Core profiles won't draw without one bound
+  GLuint fadeProgram;
+  GLuint presentProgram;
+  GLint persistence; // Uniform locations
+  GLint shift;
+  GLint background;
+  GLint foreground;
+  int current;  // Which glow texture holds the latest frame
+  Uint64 faded; // Performance counter time of the last fade pass
+} ShaderRenderer;
+
+static GLuint compileShader(GLenum type, const char *source) {
+  GLuint shader = gl.CreateShader(type);
+  GLint status = GL_FALSE;
+
+  gl.ShaderSource(shader, 1, &source, NULL);
+  gl.CompileShader(shader);
+  gl.GetShaderiv(shader, GL_COMPILE_STATUS, &status);
+  if (status != GL_TRUE) {
+    char log[1024] = "";
+    gl.GetShaderInfoLog(shader, sizeof(log), NULL, log);
+    fprintf(stderr, "Could not compile a shader: %s\n", log);
+    quitSDL();
+    exit(EXIT_FAILURE);
+  }
+  return shader;
+}
+
+static GLuint linkProgram(const char *fragmentSource) {
+  GLuint vertexShader = compileShader(GL_VERTEX_SHADER, vertexShaderSource);
+  GLuint fragmentShader = compileShader(GL_FRAGMENT_SHADER, fragmentSource);
+  GLuint program = gl.CreateProgram();
+  GLint status = GL_FALSE;
+
+  gl.AttachShader(program, vertexShader);
+  gl.AttachShader(program, fragmentShader);
+  gl.LinkProgram(program);
+  gl.DeleteShader(vertexShader);
+  gl.DeleteShader(fragmentShader);
+  gl.GetProgramiv(program, GL_LINK_STATUS, &status);
+  if (status != GL_TRUE) {
+    char log[1024] = "";
+    gl.GetProgramInfoLog(program, sizeof(log), NULL, log);
+    fprintf(stderr, "Could not link a shader: %s\n", log);
+    quitSDL();
+    exit(EXIT_FAILURE);
+  }
+  return program;
+}
+
+static GLuint createTexture(GLint format, int width, int height,
+                            GLenum pixelFormat) {
+  GLuint texture;
+
+  gl.GenTextures(1, &texture);
+  gl.BindTexture(GL_TEXTURE_2D, texture);
+  gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  gl.TexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, pixelFormat,
+                GL_UNSIGNED_BYTE, NULL);
+  return texture;
+}
+
+void startShaderRenderer(ShaderRenderer *shader) {
+  shader->fadeProgram = linkProgram(fadeShaderSource);
+  shader->presentProgram = linkProgram(presentShaderSource);
+  shader->persistence =
+      gl.GetUniformLocation(shader->fadeProgram, "persistence");
+  shader->shift = gl.GetUniformLocation(shader->fadeProgram, "shift");
+  shader->background =
+      gl.GetUniformLocation(shader->presentProgram, "background");
+  shader->foreground =
+      gl.GetUniformLocation(shader->presentProgram, "foreground");
+
+  // Each program reads the display from unit 0 and the glow from unit 1
+  gl.UseProgram(shader->fadeProgram);
+  gl.Uniform1i(gl.GetUniformLocation(shader->fadeProgram, "display"), 0);
+  gl.Uniform1i(gl.GetUniformLocation(shader->fadeProgram, "glow"), 1);
+  gl.UseProgram(shader->presentProgram);
+  gl.Uniform1i(gl.GetUniformLocation(shader->presentProgram, "glow"), 1);
+
+  gl.PixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  shader->display = createTexture(GL_R8UI, 16, 64, GL_RED_INTEGER);
+  gl.GenFramebuffers(2, shader->framebuffers);
+  for (int i = 0; i < 2; i++) {
+    shader->glow[i] = createTexture(GL_R8, 128, 64, GL_RED);
+    gl.BindFramebuffer(GL_FRAMEBUFFER, shader->framebuffers[i]);
+    gl.FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                            GL_TEXTURE_2D, shader->glow[i], 0);
+    if (gl.CheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+      fprintf(stderr, "Could not create the phosphor framebuffers\n");
+      quitSDL();
+      exit(EXIT_FAILURE);
+    }
+    gl.ClearColor(0, 0, 0, 0);
+    gl.Clear(GL_COLOR_BUFFER_BIT);
+  }
+  gl.BindFramebuffer(GL_FRAMEBUFFER, 0);
+  gl.GenVertexArrays(1, &shader->vertexArray);
+  gl.BindVertexArray(shader->vertexArray);
+  shader->current = 0;
+  shader->faded = SDL_GetPerformanceCounter();
+}
+
+void stopShaderRenderer(ShaderRenderer *shader) {
+  gl.DeleteProgram(shader->fadeProgram);
+  gl.DeleteProgram(shader->presentProgram);
+  gl.DeleteTextures(1, &shader->display);
+  gl.DeleteTextures(2, shader->glow);
+  gl.DeleteFramebuffers(2, shader->framebuffers);
+  gl.DeleteVertexArrays(1, &shader->vertexArray);
+}
+
+// Present the current frame like draw, but with the scaling and palette done
+// on the gpu. The phosphors fade every frame, so this runs the fade pass even
+// when the display hasn't changed
+static void drawShader(ShaderRenderer *shader, const uint64_t *display,
+                       bool hires) {
+  int columns = hires ? 128 : 64;
+  int rows = hires ? 64 : 32;
+
+  // Low resolution only fills the top left corner
+  if (display != NULL) {
+    uint8_t packed[64 * 16];
+    int bytes = columns / 8;
+    for (int y = 0; y < rows; y++) {
+      for (int i = 0; i < bytes; i++) {
+        packed[y * bytes + i] = display[y * bytes / 8 + i / 8] >>
+                                (56 - i % 8 * 8);
+      }
+    }
+    gl.ActiveTexture(GL_TEXTURE0);
+    gl.BindTexture(GL_TEXTURE_2D, shader->display);
+    gl.TexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, bytes, rows, GL_RED_INTEGER,
+                     GL_UNSIGNED_BYTE, packed);
+  }
+
+  // Fade last frame's glow into the other texture. Persistence is per 60 Hz
+  // frame, so it's raised to the number of those since the last fade to
+  // decay at the same rate whatever the display refreshes at
+  Uint64 now = SDL_GetPerformanceCounter();
+  double frames = (double)(now - shader->faded) * FRAME_RATE /
+                  SDL_GetPerformanceFrequency();
+  shader->faded = now;
+  int next = shader->current ^ 1;
+  gl.BindFramebuffer(GL_FRAMEBUFFER, shader->framebuffers[next]);
+  gl.Viewport(0, 0, 128, 64);
+  gl.UseProgram(shader->fadeProgram);
+  gl.Uniform1f(shader->persistence, powf(persistence, frames));
+  gl.Uniform1i(shader->shift, hires ? 0 : 1);
+  gl.ActiveTexture(GL_TEXTURE1);
+  gl.BindTexture(GL_TEXTURE_2D, shader->glow[shader->current]);
+  gl.DrawArrays(GL_TRIANGLES, 0, 3);
+  shader->current = next;
+
+  // Scale by the largest whole number that fits, centred in the window
+  int width, height;
+  SDL_GL_GetDrawableSize(window, &width, &height);
+  int factor = width / columns < height / rows ? width / columns
+                                               : height / rows;
+  if (factor < 1) {
+    factor = 1;
+  }
+
+  gl.BindFramebuffer(GL_FRAMEBUFFER, 0);
+  gl.Viewport(0, 0, width, height);
+  gl.ClearColor(0, 0, 0, 1);
+  gl.Clear(GL_COLOR_BUFFER_BIT);
+  gl.Viewport((width - columns * factor) / 2, (height - rows * factor) / 2,
+              columns * factor, rows * factor);
+  gl.UseProgram(shader->presentProgram);
+  gl.Uniform3f(shader->background, background.r / 255.0f,
+               background.g / 255.0f, background.b / 255.0f);
+  gl.Uniform3f(shader->foreground, foreground.r / 255.0f,
+               foreground.g / 255.0f, foreground.b / 255.0f);
+  gl.BindTexture(GL_TEXTURE_2D, shader->glow[next]);
+  gl.DrawArrays(GL_TRIANGLES, 0, 3);
+  SDL_GL_SwapWindow(window);
+}
+
+// Display kernels shared by the cpu and the lanes, which keep a machine's
+// display words stride apart. Every caller passes constants for the stride,
+// resolution and sprite size, so each use compiles to its own loop and the
+// low resolution ones stay as short as they always were
+
+// XOR a sprite onto the display, returning true if it turned any pixel off.
+// Sprites are 8 pixels wide, or 16 wide with two bytes a row for DXY0
+static inline bool drawSprite(uint64_t *display, int stride, uint64_t *dirty,
+                              const uint8_t *memory, uint16_t index, uint8_t x,
+                              uint8_t y, int width, int height, bool hires) {
+  int columns = hires ? 128 : 64;
+  int rows = hires ? 64 : 32;
+  bool collision = false;
+
+  x %= columns;
+  y %= rows;
+
+  // Stop if we reach the bottom of the screen
+  for (int row = 0; row < height && y + row < rows; row++) {
+    uint64_t bits = memory[(index + row * width / 8) & 0xFFF];
+    if (width == 16) {
+      bits = bits << 8 | memory[(index + row * 2 + 1) & 0xFFF];
+    }
+
+    // Line the sprite up with x, anything past the right edge of the screen
+    // is shifted off the end
+    uint64_t sprite = bits << (64 - width);
+    if (hires) {
+      int word = (y + row) * 2;
+      uint64_t *pixels = &display[word * stride];
+      uint64_t left = x < 64 ? sprite >> x : 0;
+      uint64_t right = x == 0  ? 0
+                       : x < 64 ? sprite << (64 - x)
+                                : sprite >> (x - 64);
+
+      collision |= ((pixels[0] & left) | (pixels[stride] & right)) != 0;
+      pixels[0] ^= left;
+      pixels[stride] ^= right;
+      if (dirty) {
+        dirty[word >> 6] |= 3ull << (word & 63);
+      }
+    } else {
+      uint64_t *pixels = &display[(y + row) * stride];
+      sprite >>= x;
+
+      collision |= (*pixels & sprite) != 0;
+      *pixels ^= sprite;
+      if (dirty) {
+        dirty[0] |= 1ull << (y + row);
+      }
+    }
+  }
+  return collision;
+}
+
+// Move every row down n, blanking the rows that come in at the top
+static inline void scrollDown(uint64_t *display, int stride, int n,
+                              bool hires) {
+  int words = hires ? DISPLAY_WORDS : 32;
+  int shift = hires ? n * 2 : n;
+
+  if (stride == 1) {
+    memmove(display + shift, display, (words - shift) * sizeof(uint64_t));
+    memset(display, 0, shift * sizeof(uint64_t));
+    return;
+  }
+  for (int i = words - 1; i >= 0; i--) {
+    display[i * stride] = i >= shift ? display[(i - shift) * stride] : 0;
+  }
+}
+
+// Move every row 4 pixels left or right, carrying between the two words of a
+// high resolution row
+static inline void scrollLeft(uint64_t *display, int stride, bool hires) {
+  if (!hires) {
+    for (int row = 0; row < 32; row++) {
+      display[row * stride] <<= 4;
+    }
+    return;
+  }
+  for (int row = 0; row < 64; row++) {
+    uint64_t *pixels = &display[row * 2 * stride];
+    pixels[0] = pixels[0] << 4 | pixels[stride] >> 60;
+    pixels[stride] <<= 4;
+  }
+}
+
+static inline void scrollRight(uint64_t *display, int stride, bool hires) {
+  if (!hires) {
+    for (int row = 0; row < 32; row++) {
+      display[row * stride] >>= 4;
+    }
+    return;
+  }
+  for (int row = 0; row < 64; row++) {
+    uint64_t *pixels = &display[row * 2 * stride];
+    pixels[stride] = pixels[stride] >> 4 | pixels[0] << 60;
+    pixels[0] >>= 4;
+  }
+}
+
+// Words of the display in use. Low resolution uses the first 32 as one row
+// each and leaves the rest clear, high resolution uses two words a row
+static inline int displayWords(const Chip8 *chip8) {
+  return chip8->hires ? DISPLAY_WORDS : 32;
+}
+
+static void markDisplayChanged(Chip8 *chip8) {
+  chip8->displayDirty = true;
+  chip8->dirtyWords[0] = chip8->dirtyWords[1] = ~0ull;
 }
 
 // Instruction helpers
 void jump(Chip8 *chip8, uint16_t NNN) { chip8->pc = NNN; }
 
-void push(Chip8 *chip8) {
+// Returns false and traps if the stack is full
+bool push(Chip8 *chip8) {
   if (chip8->sp > STACK_SIZE - 1) {
-    fprintf(stderr, "Stack Overflow\n");
-    quitSDL();
-    exit(EXIT_FAILURE);
+    raiseTrap(chip8, TRAP_STACK_OVERFLOW);
+    return false;
   }
   // Push pc to stack at sp then increment pointer
   chip8->stack[chip8->sp++] = chip8->pc;
+  return true;
 }
 
 void pop(Chip8 *chip8) {
@@ -167,413 +898,4208 @@ void pop(Chip8 *chip8) {
   jump(chip8, chip8->stack[--chip8->sp]);
 }
 
-void convertHexToBinaryAndLoad(Chip8 *chip8) {
-  uint8_t value = chip8->V[(chip8->opcode & 0x0F00) >> 8];
+void writeMemory(Chip8 *chip8, uint16_t address, uint8_t value) {
+  address &= 0xFFF;
+  chip8->memory[address] = value;
+  chip8->dirtyPages |= 1ull << (address / SNAPSHOT_PAGE_SIZE);
+#ifdef CHIP8_AOT
+  chip8->modifiedPages |= 1ull << (address / SNAPSHOT_PAGE_SIZE);
+#endif
+
+  // Both instructions that overlap this byte need decoding again
+  chip8->decoded[address].execute = NULL;
+  chip8->decoded[(address - 1) & 0xFFF].execute = NULL;
+
+  // As does any compiled block that contains it, which can only start in
+  // this page or the one before
+  int first = address - (MAX_BLOCK_LENGTH * 2 - 1);
+  uint64_t pages = 1ull << (address / BLOCK_PAGE_SIZE);
+  if (first >= 0) {
+    pages |= 1ull << (first / BLOCK_PAGE_SIZE);
+  }
+  if (!(chip8->blockPages & pages)) {
+    return;
+  }
+
+  for (int start = first; start <= address; start++) {
+    if (start >= 0 && start + chip8->blockLength[start] * 2 > address) {
+      chip8->blockLength[start] = 0;
+    }
+  }
+}
+
+// xorshift32, kept per machine so no state is shared between instances
+uint8_t nextRandom(Chip8 *chip8) {
+  uint32_t x = chip8->rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  chip8->rng = x;
+  return x >> 24;
+}
 
+void convertHexToBinaryAndLoad(Chip8 *chip8, uint8_t value) {
   uint8_t ones = value % 10;
   uint8_t tens = value / 10 % 10;
   uint8_t hundreds = value / 100 % 10;
 
-  chip8->memory[chip8->index + 0] = ones;
-  chip8->memory[chip8->index + 1] = tens;
-  chip8->memory[chip8->index + 2] = hundreds;
+  writeMemory(chip8, chip8->index + 0, hundreds);
+  writeMemory(chip8, chip8->index + 1, tens);
+  writeMemory(chip8, chip8->index + 2, ones);
 }
+
 // Instructions
-void nop(Chip8 *chip8) { unrecognisedOpcode(chip8->opcode); }
+void nop(Chip8 *chip8, const Instruction *in) {
+  raiseTrap(chip8, TRAP_UNRECOGNISED_OPCODE);
+}
 
-void x0(Chip8 *chip8) {
-  switch (chip8->opcode) {
-  case 0x00E0: // 00E0 - Clear screen
-    memset(chip8->display, 0, sizeof(chip8->display));
-    break;
-  case 0x00EE: // 00EE - Return from subroutine
-    pop(chip8);
-    break;
-  default:
-    unrecognisedOpcode(chip8->opcode);
-    break;
+void x00E0(Chip8 *chip8, const Instruction *in) {
+  // 00E0 - Clear screen
+  memset(chip8->display, 0, displayWords(chip8) * sizeof(uint64_t));
+  markDisplayChanged(chip8);
+}
+
+void x00CN(Chip8 *chip8, const Instruction *in) {
+  // 00CN - Scroll the display down N rows
+  if (chip8->hires) {
+    scrollDown(chip8->display, 1, in->N, true);
+  } else {
+    scrollDown(chip8->display, 1, in->N, false);
+  }
+  markDisplayChanged(chip8);
+}
+
+void x00FB(Chip8 *chip8, const Instruction *in) {
+  // 00FB - Scroll the display right 4 pixels
+  if (chip8->hires) {
+    scrollRight(chip8->display, 1, true);
+  } else {
+    scrollRight(chip8->display, 1, false);
+  }
+  markDisplayChanged(chip8);
+}
+
+void x00FC(Chip8 *chip8, const Instruction *in) {
+  // 00FC - Scroll the display left 4 pixels
+  if (chip8->hires) {
+    scrollLeft(chip8->display, 1, true);
+  } else {
+    scrollLeft(chip8->display, 1, false);
   }
+  markDisplayChanged(chip8);
+}
+
+void x00FE(Chip8 *chip8, const Instruction *in) {
+  // 00FE - Switch to the 64x32 display and clear it
+  chip8->hires = false;
+  memset(chip8->display, 0, sizeof(chip8->display));
+  markDisplayChanged(chip8);
+}
+
+void x00FF(Chip8 *chip8, const Instruction *in) {
+  // 00FF - Switch to the 128x64 display and clear it
+  chip8->hires = true;
+  memset(chip8->display, 0, sizeof(chip8->display));
+  markDisplayChanged(chip8);
+}
+
+void x00EE(Chip8 *chip8, const Instruction *in) {
+  // 00EE - Return from subroutine
+  pop(chip8);
 }
 
-void x1(Chip8 *chip8) {
+void x1NNN(Chip8 *chip8, const Instruction *in) {
   // 1NNN - Jump to address NNN
-  jump(chip8, chip8->opcode & 0x0FFF);
+  jump(chip8, in->NNN);
+}
+
+void x1NNNSelf(Chip8 *chip8, const Instruction *in) {
+  // 1NNN - Jump to address NNN, where NNN is this instruction. Nothing else
+  // can ever happen so skip the rest of the batch
+  jump(chip8, in->NNN);
+  stopBatch(chip8, STOP_IDLE);
+}
+
+void x1NNNLoop(Chip8 *chip8, const Instruction *in) {
+  // 1NNN - Jump to address NNN, where NNN is two instructions back. If those
+  // are FX07 and a skip on VX this is polling the delay timer, which can't
+  // change until the next batch, so skip every whole iteration left
+  const uint8_t *loop = &chip8->memory[in->NNN];
+  uint8_t X = loop[0] & 0x0F;
+  uint8_t skip = loop[2] & 0xF0;
+  bool polling = (loop[0] & 0xF0) == 0xF0 && loop[1] == 0x07 &&
+                 (skip == 0x30 || skip == 0x40) && (loop[2] & 0x0F) == X;
+
+  jump(chip8, in->NNN);
+
+  // It only keeps looping if the skip doesn't jump over this instruction
+  // with the current value of the timer
+  bool looping = (chip8->delay == loop[3]) == (skip == 0x40);
+  if (polling && looping && chip8->budget >= 3) {
+    chip8->budget %= 3;
+    // Which leaves VX as FX07 did on the last iteration
+    chip8->V[X] = chip8->delay;
+  }
 }
 
-void x2(Chip8 *chip8) {
+void x2NNN(Chip8 *chip8, const Instruction *in) {
   // 2NNN - Call subroutine at NNN (push pc to stack and jump)
-  push(chip8);
-  jump(chip8, chip8->opcode & 0x0FFF);
+  if (push(chip8)) {
+    jump(chip8, in->NNN);
+  }
 }
 
-void x3(Chip8 *chip8) {
+void x3XNN(Chip8 *chip8, const Instruction *in) {
   // 3XNN - Skip next instruction if VX = NN
-  uint8_t VX = chip8->V[(chip8->opcode & 0x0F00) >> 8];
-  uint16_t NN = chip8->opcode & 0xFF;
-
-  if (VX == NN) {
+  if (chip8->V[in->X] == in->NN) {
     chip8->pc += 2;
   }
 }
 
-void x4(Chip8 *chip8) {
+void x4XNN(Chip8 *chip8, const Instruction *in) {
   // 4XNN - Skip next instruction if VX != NN
-  uint8_t VX = chip8->V[(chip8->opcode & 0x0F00) >> 8];
-  uint16_t NN = chip8->opcode & 0xFF;
-
-  if (VX != NN) {
+  if (chip8->V[in->X] != in->NN) {
     chip8->pc += 2;
   }
 }
 
-void x5(Chip8 *chip8) {
+void x5XY0(Chip8 *chip8, const Instruction *in) {
   // 5XY0 - Skip next instruction if VX = VY
-  uint8_t VX = chip8->V[(chip8->opcode & 0x0F00) >> 8];
-  uint8_t VY = chip8->V[(chip8->opcode & 0x00F0) >> 8];
+  uint8_t VX = chip8->V[in->X];
+  uint8_t VY = chip8->V[in->Y];
 
   if (VX == VY) {
     chip8->pc += 2;
   }
 }
 
-void x6(Chip8 *chip8) {
+void x6XNN(Chip8 *chip8, const Instruction *in) {
   // 6XNN - Set register VX to value NN
-  chip8->V[((chip8->opcode & 0x0F00) >> 8)] = (chip8->opcode & 0x00FF);
+  chip8->V[in->X] = in->NN;
 }
 
-void x7(Chip8 *chip8) {
+void x7XNN(Chip8 *chip8, const Instruction *in) {
   // 7XNN - Add value NN to register VX
-  chip8->V[((chip8->opcode & 0x0F00) >> 8)] += (chip8->opcode & 0x00FF);
+  chip8->V[in->X] += in->NN;
 }
 
-void x8(Chip8 *chip8) {
-  uint8_t code = chip8->opcode & 0x000F;
-  uint8_t *VX = &chip8->V[(chip8->opcode & 0x0F00) >> 8];
-  uint8_t VY = chip8->V[(chip8->opcode & 0x00F0) >> 4];
-  bool x8ShiftQuirk = false;
-
-  switch (code) {
+void x8XY0(Chip8 *chip8, const Instruction *in) {
   // 8XY0 - Set VX to VY
-  case 0x0:
-    *VX = VY;
-    break;
+  chip8->V[in->X] = chip8->V[in->Y];
+}
+
+void x8XY1(Chip8 *chip8, const Instruction *in) {
   // 8XY1 - Place the result of a bitwise OR on VX and VY into VX
-  case 0x1:
-    *VX |= VY;
-    break;
+  chip8->V[in->X] |= chip8->V[in->Y];
+}
+
+void x8XY2(Chip8 *chip8, const Instruction *in) {
   // 8XY2 - Place the result of a bitwise AND on VX and VY into VX
-  case 0x2:
-    *VX &= VY;
-    break;
+  chip8->V[in->X] &= chip8->V[in->Y];
+}
+
+void x8XY3(Chip8 *chip8, const Instruction *in) {
   // 8XY3 - Place the result of a bitwise XOR on VX and VY into VX
-  case 0x3:
-    *VX ^= VY;
-    break;
+  chip8->V[in->X] ^= chip8->V[in->Y];
+}
+
+// The original interpreter left VF cleared after the logic instructions
+void x8XY1Reset(Chip8 *chip8, const Instruction *in) {
+  x8XY1(chip8, in);
+  chip8->V[0xF] = 0;
+}
+
+void x8XY2Reset(Chip8 *chip8, const Instruction *in) {
+  x8XY2(chip8, in);
+  chip8->V[0xF] = 0;
+}
+
+void x8XY3Reset(Chip8 *chip8, const Instruction *in) {
+  x8XY3(chip8, in);
+  chip8->V[0xF] = 0;
+}
+
+void x8XY4(Chip8 *chip8, const Instruction *in) {
   // 8XY4 - Add VX and VY and put it in VX. Set VF if it overflows
-  case 0x4:
-    chip8->V[0xF] = ((*VX + VY) > 0xFF);
-    *VX += VY;
-    break;
+  uint8_t VX = chip8->V[in->X];
+  uint8_t VY = chip8->V[in->Y];
+
+  // VF is written last so it keeps the flag when it is also VX
+  chip8->V[in->X] = VX + VY;
+  chip8->V[0xF] = ((VX + VY) > 0xFF);
+}
+
+void x8XY5(Chip8 *chip8, const Instruction *in) {
   // 8XY5 - Subtract VY from VX and put it in VX. Set VF to 1 unless it
   // underflows in which case set it to 0
-  case 0x5:
-    chip8->V[0xF] = (VY > *VX ? 0x0 : 0x1);
-    *VX -= VY;
-    break;
-  // 8XY6 - Shift VX one bit right. Set VX to VY if using quirk
-  case 0x6:
-    if (x8ShiftQuirk) {
-      *VX = VY;
-    }
-    chip8->V[0xF] = (*VX & 1);
-    *VX >>= 1;
-    break;
+  uint8_t VX = chip8->V[in->X];
+  uint8_t VY = chip8->V[in->Y];
+
+  chip8->V[in->X] = VX - VY;
+  chip8->V[0xF] = (VY > VX ? 0x0 : 0x1);
+}
+
+// Shared by the 8XY6 handlers, which pass a constant for the quirk so each
+// one is compiled without the check
+static inline void shiftRight(Chip8 *chip8, const Instruction *in,
+                              bool x8ShiftQuirk) {
+  // 8XY6 - Shift VX one bit right. Shift VY into VX if using quirk
+  uint8_t value = chip8->V[x8ShiftQuirk ? in->Y : in->X];
+
+  chip8->V[in->X] = value >> 1;
+  chip8->V[0xF] = (value & 1);
+}
+
+void x8XY6(Chip8 *chip8, const Instruction *in) {
+  shiftRight(chip8, in, false);
+}
+
+void x8XY6Quirk(Chip8 *chip8, const Instruction *in) {
+  shiftRight(chip8, in, true);
+}
+
+void x8XY7(Chip8 *chip8, const Instruction *in) {
   // 8XY7 - Subtract VX from VY and put it in VX. Set VF to 1 unless it
   // underflows in which case set it to 0
-  case 0x7:
-    chip8->V[0xF] = (*VX > VY ? 0x0 : 0x1);
-    *VX = VY - *VX;
-    break;
-  // 8XYE - Shift VX one bit left. Set VX to VY if using quirk
-  case 0xE:
-    if (x8ShiftQuirk) {
-      *VX = VY;
-    }
-    chip8->V[0xF] = (*VX > 7);
-    *VX <<= 1;
-    break;
-  default:
-    unrecognisedOpcode(chip8->opcode);
-    break;
-  }
+  uint8_t VX = chip8->V[in->X];
+  uint8_t VY = chip8->V[in->Y];
+
+  chip8->V[in->X] = VY - VX;
+  chip8->V[0xF] = (VX > VY ? 0x0 : 0x1);
 }
 
-void x9(Chip8 *chip8) {
+static inline void shiftLeft(Chip8 *chip8, const Instruction *in,
+                             bool x8ShiftQuirk) {
+  // 8XYE - Shift VX one bit left. Shift VY into VX if using quirk
+  uint8_t value = chip8->V[x8ShiftQuirk ? in->Y : in->X];
+
+  chip8->V[in->X] = value << 1;
+  chip8->V[0xF] = value >> 7;
+}
+
+void x8XYE(Chip8 *chip8, const Instruction *in) {
+  shiftLeft(chip8, in, false);
+}
+
+void x8XYEQuirk(Chip8 *chip8, const Instruction *in) {
+  shiftLeft(chip8, in, true);
+}
+
+void x9XY0(Chip8 *chip8, const Instruction *in) {
   // 9XY0 - Skip next instruction if VX != VY
-  uint8_t VX = chip8->V[(chip8->opcode & 0x0F00) >> 8];
-  uint8_t VY = chip8->V[(chip8->opcode & 0x00F0) >> 8];
+  uint8_t VX = chip8->V[in->X];
+  uint8_t VY = chip8->V[in->Y];
 
   if (VX != VY) {
     chip8->pc += 2;
   }
 }
 
-void xA(Chip8 *chip8) {
+void xANNN(Chip8 *chip8, const Instruction *in) {
   // ANNN - Set Index register to address NNN
-  chip8->index = (chip8->opcode & 0x0FFF);
+  chip8->index = in->NNN;
 }
 
-void xB(Chip8 *chip8) {
-  bool xBJumpQuirk = false;
-
-  // BNNN - Jumps to address NNN + V0. If the quirx is enabled it instead
-  // interprets it as XNN and jumps to address XNN + VX
-  uint16_t NNN = chip8->opcode & 0x0FFF;
+void xBNNN(Chip8 *chip8, const Instruction *in) {
+  // BNNN - Jumps to address NNN + V0
+  jump(chip8, in->NNN + chip8->V[0x0]);
+}
 
-  if (xBJumpQuirk) {
-    NNN += chip8->V[(chip8->opcode & 0x0F00) >> 8];
-  } else {
-    NNN += chip8->V[0x0];
-  }
-  jump(chip8, NNN);
+void xBXNN(Chip8 *chip8, const Instruction *in) {
+  // BXNN - With the jump quirk the instruction is instead interpreted as XNN
+  // and jumps to address XNN + VX
+  jump(chip8, in->NNN + chip8->V[in->X]);
 }
 
-void xC(Chip8 *chip8) {
+void xCXNN(Chip8 *chip8, const Instruction *in) {
   // CXNN - Set VX to the result of a random number ANDed with NN
-  uint8_t NN = chip8->opcode & 0x00FF;
-  uint8_t *VX = &chip8->V[(chip8->opcode & 0x0F00) >> 8];
+  chip8->V[in->X] = nextRandom(chip8) & in->NN;
+}
 
-  uint8_t random = rand() & NN;
+void xDXYN(Chip8 *chip8, const Instruction *in) {
+  // DXYN - Draw a sprite N pixels tall from the index register at position
+  // VX, VY, setting VF if any pixel that is already on gets turned off
+  uint8_t X = chip8->V[in->X];
+  uint8_t Y = chip8->V[in->Y];
 
-  *VX = random;
+  chip8->V[0xF] =
+      chip8->hires ? drawSprite(chip8->display, 1, chip8->dirtyWords,
+                                chip8->memory, chip8->index, X, Y, 8, in->N,
+                                true)
+                   : drawSprite(chip8->display, 1, chip8->dirtyWords,
+                                chip8->memory, chip8->index, X, Y, 8, in->N,
+                                false);
+  chip8->displayDirty = true;
 }
 
-void xE(Chip8 *chip8) {
-  uint8_t *VX = &chip8->V[(chip8->opcode & 0x0F00) >> 8];
-  bool isKeyPressed = chip8->keypad[*VX];
+void xDXY0(Chip8 *chip8, const Instruction *in) {
+  // DXY0 - Draw a 16x16 sprite from the index register at position VX, VY
+  uint8_t X = chip8->V[in->X];
+  uint8_t Y = chip8->V[in->Y];
 
-  switch (chip8->opcode & 0x00FF) {
-  // EX9E - Skip next instruction if key VX is pressed
-  case 0x9E:
-    if (isKeyPressed) {
-      chip8->pc += 2;
-    }
-    break;
-  // EXA1 - Skip next instruction if key VX isn't pressed
-  case 0xA1:
-    if (!isKeyPressed) {
-      chip8->pc += 2;
+  chip8->V[0xF] =
+      chip8->hires ? drawSprite(chip8->display, 1, chip8->dirtyWords,
+                                chip8->memory, chip8->index, X, Y, 16, 16,
+                                true)
+                   : drawSprite(chip8->display, 1, chip8->dirtyWords,
+                                chip8->memory, chip8->index, X, Y, 16, 16,
+                                false);
+  chip8->displayDirty = true;
+}
+
+void xDXY0Hires(Chip8 *chip8, const Instruction *in) {
+  // DXY0 - Without the SUPER-CHIP quirk the 16x16 sprite is only drawn at
+  // high resolution, at low resolution it's a sprite with no rows
+  if (chip8->hires) {
+    xDXY0(chip8, in);
+  } else {
+    xDXYN(chip8, in);
+  }
+}
+
+void xDXYNWait(Chip8 *chip8, const Instruction *in) {
+  // DXYN - With the display wait quirk drawing waits for the vertical blank,
+  // so nothing else runs until the next frame
+  xDXYN(chip8, in);
+  stopBatch(chip8, STOP_DRAW_WAIT);
+}
+
+void xEX9E(Chip8 *chip8, const Instruction *in) {
+  // EX9E - Skip next instruction if key VX is pressed. Only the low nibble
+  // of VX names a key
+  if (chip8->keypad[chip8->V[in->X] & 0xF]) {
+    chip8->pc += 2;
+  }
+}
+
+void xEXA1(Chip8 *chip8, const Instruction *in) {
+  // EXA1 - Skip next instruction if key VX isn't pressed
+  if (!chip8->keypad[chip8->V[in->X] & 0xF]) {
+    chip8->pc += 2;
+  }
+}
+
+void xFX07(Chip8 *chip8, const Instruction *in) {
+  // FX07 - Set VX to the contents of the delay timer
+  chip8->V[in->X] = chip8->delay;
+}
+
+void xFX0A(Chip8 *chip8, const Instruction *in) {
+  // FX0A - Get pressed key and put it in VX
+  for (int i = 0; i < 0x10; i++) {
+    if (chip8->keypad[i]) {
+      chip8->V[in->X] = i;
+      return;
+    }
+  }
+  chip8->pc -= 2;
+
+  // The keypad can't change until the next batch so there's no point
+  // waiting any longer in this one
+  stopBatch(chip8, STOP_KEY_WAIT);
+}
+
+void xFX15(Chip8 *chip8, const Instruction *in) {
+  // FX15 - Set the delay timer to the value in VX
+  chip8->delay = chip8->V[in->X];
+}
+
+void xFX18(Chip8 *chip8, const Instruction *in) {
+  // FX18 - Set the sound timer to the value in VX
+  chip8->sound = chip8->V[in->X];
+}
+
+void xFX1E(Chip8 *chip8, const Instruction *in) {
+  // FX1E - Add VX to index register
+  chip8->index += chip8->V[in->X];
+  // Set VF if index overflows addressable range
+  chip8->V[0xF] = chip8->index >= 0x1000;
+}
+
+void xFX29(Chip8 *chip8, const Instruction *in) {
+  // FX29 - Point index to font in memory for VX
+  chip8->index = (0 + (chip8->V[in->X] * 5));
+}
+
+void xFX33(Chip8 *chip8, const Instruction *in) {
+  // FX33 - Convert VX to a binary number and store each digit in memory
+  convertHexToBinaryAndLoad(chip8, chip8->V[in->X]);
+}
+
+// Shared by the FX55 and FX65 handlers. How far the index moves afterwards
+// depends on the quirks and is passed as a constant so it folds away
+static inline void storeRegisters(Chip8 *chip8, const Instruction *in,
+                                  int xFIndexQuirk) {
+  // FX55 - Store variables up to VX in successive memory locations
+  uint16_t initialIndex = chip8->index;
+
+  for (int i = 0; i <= in->X; i++) {
+    writeMemory(chip8, initialIndex + i, chip8->V[i]);
+  }
+  chip8->index += xFIndexQuirk;
+}
+
+static inline void loadRegisters(Chip8 *chip8, const Instruction *in,
+                                 int xFIndexQuirk) {
+  // FX65 - Load registers up to VX from successive memory locations
+  uint16_t initialIndex = chip8->index;
+
+  for (int i = 0; i <= in->X; i++) {
+    chip8->V[i] = chip8->memory[(initialIndex + i) & 0xFFF];
+  }
+  chip8->index += xFIndexQuirk;
+}
+
+void xFX55(Chip8 *chip8, const Instruction *in) {
+  storeRegisters(chip8, in, 0);
+}
+
+void xFX55Index(Chip8 *chip8, const Instruction *in) {
+  storeRegisters(chip8, in, in->X + 1);
+}
+
+void xFX55IndexX(Chip8 *chip8, const Instruction *in) {
+  storeRegisters(chip8, in, in->X);
+}
+
+void xFX65(Chip8 *chip8, const Instruction *in) {
+  loadRegisters(chip8, in, 0);
+}
+
+void xFX65Index(Chip8 *chip8, const Instruction *in) {
+  loadRegisters(chip8, in, in->X + 1);
+}
+
+void xFX65IndexX(Chip8 *chip8, const Instruction *in) {
+  loadRegisters(chip8, in, in->X);
+}
+
+// Look up the handler for an opcode once so executing it later is a single
+// indirect call with no further switching. Quirks pick between handlers here
+// rather than being checked when the instruction runs
+Handler handlerFor(uint16_t opcode, uint8_t quirks) {
+  switch ((opcode & 0xF000) >> 12) {
+  case 0x0:
+    switch (opcode) {
+    case 0x00E0:
+      return x00E0;
+    case 0x00EE:
+      return x00EE;
+    case 0x00FB:
+      return x00FB;
+    case 0x00FC:
+      return x00FC;
+    case 0x00FE:
+      return x00FE;
+    case 0x00FF:
+      return x00FF;
+    }
+    if ((opcode & 0xFFF0) == 0x00C0) {
+      return x00CN;
+    }
+    break;
+  case 0x1:
+    return x1NNN;
+  case 0x2:
+    return x2NNN;
+  case 0x3:
+    return x3XNN;
+  case 0x4:
+    return x4XNN;
+  case 0x5:
+    return x5XY0;
+  case 0x6:
+    return x6XNN;
+  case 0x7:
+    return x7XNN;
+  case 0x8:
+    switch (opcode & 0x000F) {
+    case 0x0:
+      return x8XY0;
+    case 0x1:
+      return quirks & QUIRK_VF_RESET ? x8XY1Reset : x8XY1;
+    case 0x2:
+      return quirks & QUIRK_VF_RESET ? x8XY2Reset : x8XY2;
+    case 0x3:
+      return quirks & QUIRK_VF_RESET ? x8XY3Reset : x8XY3;
+    case 0x4:
+      return x8XY4;
+    case 0x5:
+      return x8XY5;
+    case 0x6:
+      return quirks & QUIRK_SHIFT_VY ? x8XY6Quirk : x8XY6;
+    case 0x7:
+      return x8XY7;
+    case 0xE:
+      return quirks & QUIRK_SHIFT_VY ? x8XYEQuirk : x8XYE;
+    }
+    break;
+  case 0x9:
+    return x9XY0;
+  case 0xA:
+    return xANNN;
+  case 0xB:
+    return quirks & QUIRK_JUMP_VX ? xBXNN : xBNNN;
+  case 0xC:
+    return xCXNN;
+  case 0xD:
+    // The display wait quirk is from machines that never had 16x16 sprites,
+    // where DXY0 draws no rows like any other DXYN
+    if ((opcode & 0x000F) == 0 && !(quirks & QUIRK_DISPLAY_WAIT)) {
+      return quirks & QUIRK_SPRITE16 ? xDXY0 : xDXY0Hires;
+    }
+    return quirks & QUIRK_DISPLAY_WAIT ? xDXYNWait : xDXYN;
+  case 0xE:
+    switch (opcode & 0x00FF) {
+    case 0x9E:
+      return xEX9E;
+    case 0xA1:
+      return xEXA1;
+    }
+    break;
+  case 0xF:
+    switch (opcode & 0x00FF) {
+    case 0x07:
+      return xFX07;
+    case 0x0A:
+      return xFX0A;
+    case 0x15:
+      return xFX15;
+    case 0x18:
+      return xFX18;
+    case 0x1E:
+      return xFX1E;
+    case 0x29:
+      return xFX29;
+    case 0x33:
+      return xFX33;
+    case 0x55:
+      return quirks & QUIRK_INDEX     ? xFX55Index
+             : quirks & QUIRK_INDEX_X ? xFX55IndexX
+                                      : xFX55;
+    case 0x65:
+      return quirks & QUIRK_INDEX     ? xFX65Index
+             : quirks & QUIRK_INDEX_X ? xFX65IndexX
+                                      : xFX65;
+    }
+    break;
+  }
+  return nop;
+}
+
+Instruction decode(uint16_t opcode, uint8_t quirks) {
+  Instruction instruction = {
+      .execute = handlerFor(opcode, quirks),
+      .opcode = opcode,
+      .NNN = opcode & 0x0FFF,
+      .X = (opcode & 0x0F00) >> 8,
+      .Y = (opcode & 0x00F0) >> 4,
+      .N = opcode & 0x000F,
+      .NN = opcode & 0x00FF,
+  };
+  return instruction;
+}
+
+// Get the decoded instruction at an address, decoding it on first use
+Instruction *fetch(Chip8 *chip8, uint16_t address) {
+  address &= 0xFFF;
+  Instruction *instruction = &chip8->decoded[address];
+
+  if (instruction->execute == NULL) {
+    *instruction = decode(chip8->memory[address] << 8 |
+                              chip8->memory[(address + 1) & 0xFFF],
+                          chip8->quirks);
+
+    // Jumps that might be idle loops get handlers that can skip them
+    if (instruction->execute == x1NNN && instruction->NNN == address) {
+      instruction->execute = x1NNNSelf;
+    } else if (instruction->execute == x1NNN &&
+               instruction->NNN == address - 4) {
+      instruction->execute = x1NNNLoop;
+    }
+  }
+  return instruction;
+}
+
+// Opcode patterns for each handler, used when reporting on instructions, and
+// the handler's own name for generating code that calls it
+typedef struct HandlerName {
+  Handler handler;
+  const char *pattern;
+  const char *name;
+} HandlerName;
+
+#define HANDLER(handler, pattern) {handler, pattern, #handler}
+
+const HandlerName handlerNames[] = {
+    HANDLER(nop, "????"), HANDLER(x00E0, "00E0"), HANDLER(x00EE, "00EE"),
+    HANDLER(x1NNN, "1NNN"), HANDLER(x1NNNSelf, "1NNN"),
+    HANDLER(x1NNNLoop, "1NNN"), HANDLER(x2NNN, "2NNN"), HANDLER(x3XNN, "3XNN"),
+    HANDLER(x4XNN, "4XNN"), HANDLER(x5XY0, "5XY0"), HANDLER(x6XNN, "6XNN"),
+    HANDLER(x7XNN, "7XNN"), HANDLER(x8XY0, "8XY0"), HANDLER(x8XY1, "8XY1"),
+    HANDLER(x8XY2, "8XY2"), HANDLER(x8XY3, "8XY3"), HANDLER(x8XY4, "8XY4"),
+    HANDLER(x8XY5, "8XY5"), HANDLER(x8XY6, "8XY6"), HANDLER(x8XY7, "8XY7"),
+    HANDLER(x8XYE, "8XYE"), HANDLER(x9XY0, "9XY0"), HANDLER(xANNN, "ANNN"),
+    HANDLER(xBNNN, "BNNN"), HANDLER(xCXNN, "CXNN"), HANDLER(xDXYN, "DXYN"),
+    HANDLER(xEX9E, "EX9E"), HANDLER(xEXA1, "EXA1"), HANDLER(xFX07, "FX07"),
+    HANDLER(xFX0A, "FX0A"), HANDLER(xFX15, "FX15"), HANDLER(xFX18, "FX18"),
+    HANDLER(xFX1E, "FX1E"), HANDLER(xFX29, "FX29"), HANDLER(xFX33, "FX33"),
+    HANDLER(xFX55, "FX55"), HANDLER(xFX65, "FX65"), HANDLER(x8XY1Reset, "8XY1"),
+    HANDLER(x8XY2Reset, "8XY2"), HANDLER(x8XY3Reset, "8XY3"),
+    HANDLER(x8XY6Quirk, "8XY6"), HANDLER(x8XYEQuirk, "8XYE"),
+    HANDLER(xBXNN, "BXNN"), HANDLER(xFX55Index, "FX55"),
+    HANDLER(xFX55IndexX, "FX55"), HANDLER(xFX65Index, "FX65"),
+    HANDLER(xFX65IndexX, "FX65"), HANDLER(xDXYNWait, "DXYN"),
+    HANDLER(x00CN, "00CN"), HANDLER(x00FB, "00FB"), HANDLER(x00FC, "00FC"),
+    HANDLER(x00FE, "00FE"), HANDLER(x00FF, "00FF"), HANDLER(xDXY0, "DXY0"),
+    HANDLER(xDXY0Hires, "DXY0"),
+};
+
+#define HANDLER_COUNT (sizeof(handlerNames) / sizeof(handlerNames[0]))
+
+int handlerIndex(Handler handler) {
+  for (size_t i = 0; i < HANDLER_COUNT; i++) {
+    if (handlerNames[i].handler == handler) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+#ifdef CHIP8_PROFILE
+#define PROFILE_INSTRUCTION(chip8, instruction, address)                      \
+  profileInstruction(chip8, instruction, address)
+
+void profileInstruction(Chip8 *chip8, const Instruction *instruction,
+                        uint16_t address) {
+  Profile *profile = &chip8->profile;
+
+  profile->opcodes[instruction->opcode]++;
+  profile->addresses[address & 0xFFF]++;
+  // Anything that leaves pc where it was is spinning, like FX0A waiting for
+  // a key or 1NNN jumping to itself
+  if (chip8->pc == address) {
+    profile->spins[address & 0xFFF]++;
+  }
+}
+
+typedef struct ProfileEntry {
+  uint64_t count;
+  int key;
+} ProfileEntry;
+
+static int compareProfileEntries(const void *a, const void *b) {
+  uint64_t countA = ((const ProfileEntry *)a)->count;
+  uint64_t countB = ((const ProfileEntry *)b)->count;
+  return (countA < countB) - (countA > countB);
+}
+
+// Print the per handler histogram, the hottest addresses and any spin loops
+// to stderr, and write folded stacks that flamegraph.pl can read
+void printProfile(const Chip8 *chip8) {
+  const Profile *profile = &chip8->profile;
+  ProfileEntry handlers[HANDLER_COUNT] = {0};
+  uint64_t total = 0;
+
+  for (size_t i = 0; i < HANDLER_COUNT; i++) {
+    handlers[i].key = i;
+  }
+  for (int opcode = 0; opcode < 0x10000; opcode++) {
+    handlers[handlerIndex(handlerFor(opcode, chip8->quirks))].count +=
+        profile->opcodes[opcode];
+    total += profile->opcodes[opcode];
+  }
+  if (total == 0) {
+    return;
+  }
+
+  qsort(handlers, HANDLER_COUNT, sizeof(handlers[0]), compareProfileEntries);
+  fprintf(stderr, "%" PRIu64 " instructions\n", total);
+  for (size_t i = 0; i < HANDLER_COUNT && handlers[i].count > 0; i++) {
+    fprintf(stderr, "%12" PRIu64 " %6.2f%% %s\n", handlers[i].count,
+            handlers[i].count * 100.0 / total,
+            handlerNames[handlers[i].key].pattern);
+  }
+
+  static ProfileEntry addresses[4096];
+  for (int i = 0; i < 4096; i++) {
+    addresses[i] = (ProfileEntry){profile->addresses[i], i};
+  }
+  qsort(addresses, 4096, sizeof(addresses[0]), compareProfileEntries);
+  fprintf(stderr, "hottest addresses\n");
+  for (int i = 0; i < 16 && addresses[i].count > 0; i++) {
+    int address = addresses[i].key;
+    uint16_t opcode =
+        chip8->memory[address] << 8 | chip8->memory[(address + 1) & 0xFFF];
+    fprintf(stderr, "%12" PRIu64 " 0x%04x %04x%s\n", addresses[i].count,
+            address, opcode, profile->spins[address] ? " (spins)" : "");
+  }
+
+  for (int address = 0; address < 4096; address++) {
+    if (profile->spins[address] > 0) {
+      fprintf(stderr, "hot loop: 0x%04x spun %" PRIu64 " times\n", address,
+              profile->spins[address]);
+    }
+  }
+
+  FILE *folded = fopen("profile.folded", "w");
+  if (folded == NULL) {
+    fprintf(stderr, "Could not open profile.folded\n");
+    return;
+  }
+  for (int address = 0; address < 4096; address++) {
+    if (profile->addresses[address] > 0) {
+      uint16_t opcode =
+          chip8->memory[address] << 8 | chip8->memory[(address + 1) & 0xFFF];
+      fprintf(folded, "%s;0x%04x %" PRIu64 "\n",
+              handlerNames[handlerIndex(handlerFor(opcode, chip8->quirks))]
+                  .pattern,
+              address,
+              profile->addresses[address]);
+    }
+  }
+  fclose(folded);
+}
+#else
+#define PROFILE_INSTRUCTION(chip8, instruction, address)
+#endif
+
+void cpuCycle(Chip8 *chip8) {
+  // Fetch
+  uint16_t address = chip8->pc;
+  Instruction *instruction = fetch(chip8, address);
+  chip8->opcode = instruction->opcode;
+  chip8->pc += 2;
+
+  // Execute
+  instruction->execute(chip8, instruction);
+  PROFILE_INSTRUCTION(chip8, instruction, address);
+}
+
+// Instructions that can move pc somewhere other than the next instruction,
+// or write to memory, have to be the last instruction in a block
+bool endsBlock(const Instruction *instruction) {
+  Handler execute = instruction->execute;
+
+  return execute == x00EE || execute == x1NNN || execute == x1NNNSelf ||
+         execute == x1NNNLoop || execute == x2NNN || execute == xBNNN ||
+         execute == xBXNN || execute == x3XNN || execute == x4XNN ||
+         execute == x5XY0 || execute == x9XY0 || execute == xEX9E ||
+         execute == xEXA1 || execute == xFX0A || execute == xFX33 ||
+         execute == xFX55 || execute == xFX55Index ||
+         execute == xFX55IndexX || execute == xDXYNWait || execute == nop;
+}
+
+// Decode the straight-line run of instructions starting at an address and
+// record how long it is so it can be executed without any lookups
+int compileBlock(Chip8 *chip8, uint16_t start) {
+  int length = 0;
+
+  for (uint16_t address = start; address < 0xFFF; address += 2) {
+    length++;
+    if (endsBlock(fetch(chip8, address)) || length == MAX_BLOCK_LENGTH) {
+      break;
+    }
+  }
+
+  chip8->blockLength[start] = length;
+  chip8->blockPages |= 1ull << (start / BLOCK_PAGE_SIZE);
+  return length;
+}
+
+// Execute the block at pc, or as much of it as fits in the budget
+void runBlock(Chip8 *chip8) {
+  uint16_t start = chip8->pc & 0xFFF;
+  int length = chip8->blockLength[start];
+
+  // The instruction at 0xFFF wraps around to address 0, so it can't be part
+  // of a block and is always interpreted
+  if (start == 0xFFF) {
+    chip8->budget--;
+    cpuCycle(chip8);
+    return;
+  }
+  if (length == 0) {
+    length = compileBlock(chip8, start);
+  }
+  if (length > chip8->budget) {
+    length = chip8->budget;
+  }
+  chip8->budget -= length;
+
+  chip8->pc = start;
+  Instruction *instruction = &chip8->decoded[start];
+  for (int i = 0; i < length; i++, instruction += 2) {
+    chip8->opcode = instruction->opcode;
+    chip8->pc += 2;
+    instruction->execute(chip8, instruction);
+    PROFILE_INSTRUCTION(chip8, instruction, start + i * 2);
+  }
+}
+
+#ifdef CHIP8_AOT
+// Called as a compiled block is entered, returning how many of its
+// instructions to run. Like runBlock that's as many as fit in the budget, or
+// none if any of the memory it was compiled from has been written
+static inline int enterCompiledBlock(Chip8 *chip8, uint64_t pages,
+                                     int length) {
+  if (chip8->modifiedPages & pages) {
+    return 0;
+  }
+  if (length > chip8->budget) {
+    length = chip8->budget;
+  }
+  chip8->budget -= length;
+  return length;
+}
+#endif
+
+// Run up to budget cycles, stopping early once nothing more can happen
+// until the next frame or the cpu traps. The budget lives in the machine so
+// instructions that detect an idle loop can skip the cycles it would have
+// spun for. A trapped machine stays stopped until its trap is cleared
+StopReason runCycles(Chip8 *chip8, long budget) {
+  if (chip8->trap.code != TRAP_NONE) {
+    return STOP_TRAP;
+  }
+  chip8->budget = budget;
+  chip8->stop = STOP_BUDGET;
+
+#ifdef CHIP8_AOT
+  // Anywhere without a compiled block, such as a BNNN target or code that
+  // has been written over, falls back to the interpreter
+  if (chip8->compiled && chip8->quirks == compiledQuirks) {
+    while (chip8->budget > 0) {
+      if (!runCompiledBlock(chip8)) {
+        chip8->budget--;
+        cpuCycle(chip8);
+      }
+    }
+    return chip8->stop;
+  }
+#endif
+
+  if (!chip8->blockCache) {
+    while (chip8->budget > 0) {
+      chip8->budget--;
+      cpuCycle(chip8);
+    }
+    return chip8->stop;
+  }
+
+  while (chip8->budget > 0) {
+    runBlock(chip8);
+  }
+  return chip8->stop;
+}
+
+const int keymap[16] = {
+    SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3, SDL_SCANCODE_4,
+    SDL_SCANCODE_Q, SDL_SCANCODE_W, SDL_SCANCODE_E, SDL_SCANCODE_R,
+    SDL_SCANCODE_A, SDL_SCANCODE_S, SDL_SCANCODE_D, SDL_SCANCODE_F,
+    SDL_SCANCODE_Z, SDL_SCANCODE_X, SDL_SCANCODE_C, SDL_SCANCODE_V};
+
+// The bit a key sets in a keys bitmask, which has a bit for each key on the
+// keypad and REWIND_KEY for Backspace, or 0 for any other key
+Uint32 keyBit(SDL_Scancode scancode) {
+  for (int i = 0; i < 0x10; i++) {
+    if (keymap[i] == scancode) {
+      return 1u << i;
+    }
+  }
+  switch (scancode) {
+  case SDL_SCANCODE_BACKSPACE:
+    return REWIND_KEY;
+  case SDL_SCANCODE_TAB:
+    return FAST_FORWARD_KEY;
+  default:
+    return 0;
+  }
+}
+
+void setKeypad(Chip8 *chip8, Uint32 keys) {
+  for (int i = 0; i < 0x10; i++) {
+    chip8->keypad[i] = (keys >> i) & 1;
+  }
+}
+
+void updateTimers(Chip8 *chip8) {
+  if (chip8->delay > 0) {
+    chip8->delay--;
+  }
+
+  if (chip8->sound > 0) {
+    chip8->sound--;
+  }
+}
+
+// How many cycles the next frame gets. The remainder of clockSpeed / 60 is
+// carried over to later frames so the clock rate comes out exact
+long frameCycles(Chip8 *chip8) {
+  long cycles = (chip8->clockPhase + chip8->clockSpeed) / FRAME_RATE;
+  chip8->clockPhase = (chip8->clockPhase + chip8->clockSpeed) % FRAME_RATE;
+  return cycles;
+}
+
+// The keys held from some number of cycles into a batch
+typedef struct KeyChange {
+  long cycle;
+  Uint32 keys;
+} KeyChange;
+
+// Run a batch of cycles, switching the keypad to each change as the batch
+// reaches it so input lands where it happened rather than at the start of
+// the next batch. Changes must be in order
+StopReason runCyclesWithKeys(Chip8 *chip8, long cycles,
+                             const KeyChange *changes, int count) {
+  StopReason stop = STOP_BUDGET;
+  long done = 0;
+
+  for (int i = 0; i <= count; i++) {
+    long until = i < count && changes[i].cycle < cycles ? changes[i].cycle
+                                                        : cycles;
+
+    // Drawing and trapping end the batch, but every other early stop is
+    // waiting on something a key press might change, such as FX0A, so it
+    // gets to carry on from the change
+    if (until > done && stop != STOP_DRAW_WAIT && stop != STOP_TRAP) {
+      stop = runCycles(chip8, until - done);
+    }
+    if (until > done) {
+      done = until;
+    }
+    if (i < count) {
+      setKeypad(chip8, changes[i].keys);
+    }
+  }
+  return stop;
+}
+
+// Run one frame's worth of cycles, then tick the timers unless it trapped
+StopReason runFrame(Chip8 *chip8, const KeyChange *changes, int count) {
+  StopReason stop =
+      runCyclesWithKeys(chip8, frameCycles(chip8), changes, count);
+
+  if (stop != STOP_TRAP) {
+    updateTimers(chip8);
+  }
+  return stop;
+}
+
+// FNV-1a hash of the display so runs can be compared without dumping pixels
+uint64_t hashDisplay(const Chip8 *chip8) {
+  uint64_t hash = 0xcbf29ce484222325;
+
+  // Hash rows a byte at a time from the left so it doesn't depend on
+  // endianness
+  for (int i = 0; i < displayWords(chip8); i++) {
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      hash ^= (chip8->display[i] >> shift) & 0xFF;
+      hash *= 0x100000001b3;
+    }
+  }
+  return hash;
+}
+
+// The memory image straight after a ROM was loaded, which snapshots are
+// stored relative to
+typedef struct BaseImage {
+  uint8_t memory[4096];
+  uint64_t hash;
+} BaseImage;
+
+uint64_t hashBytes(const uint8_t *bytes, size_t size) {
+  uint64_t hash = 0xcbf29ce484222325;
+
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+// Snapshots are little endian regardless of the host
+static uint8_t *putValue(uint8_t *out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    *out++ = value >> (i * 8);
+  }
+  return out;
+}
+
+static uint64_t getValue(const uint8_t **in, int bytes) {
+  uint64_t value = 0;
+
+  for (int i = 0; i < bytes; i++) {
+    value |= (uint64_t)*(*in)++ << (i * 8);
+  }
+  return value;
+}
+
+void captureBase(BaseImage *base, const Chip8 *chip8) {
+  memcpy(base->memory, chip8->memory, sizeof(base->memory));
+  base->hash = hashBytes(base->memory, sizeof(base->memory));
+}
+
+// Write a snapshot of everything needed to resume the machine. Memory is
+// stored as the pages that differ from the base image, so the same ROM has to
+// be loaded before restoring. buffer must hold MAX_SNAPSHOT_SIZE bytes and
+// the length used is returned
+size_t saveState(const Chip8 *chip8, const BaseImage *base, uint8_t *buffer) {
+  uint8_t *out = buffer;
+
+  memcpy(out, "CH8S", 4);
+  out += 4;
+  *out++ = SNAPSHOT_VERSION;
+  out = putValue(out, base->hash, 8);
+
+  out = putValue(out, chip8->pc, 2);
+  out = putValue(out, chip8->index, 2);
+  out = putValue(out, chip8->sp, 1);
+  out = putValue(out, chip8->delay, 1);
+  out = putValue(out, chip8->sound, 1);
+  out = putValue(out, chip8->rng, 4);
+  out = putValue(out, chip8->clockPhase, 1);
+  out = putValue(out, chip8->hires, 1);
+  memcpy(out, chip8->V, sizeof(chip8->V));
+  out += sizeof(chip8->V);
+  for (int i = 0; i < STACK_SIZE; i++) {
+    out = putValue(out, chip8->stack[i], 2);
+  }
+
+  uint16_t keys = 0;
+  for (int i = 0; i < 0x10; i++) {
+    keys |= (chip8->keypad[i] != 0) << i;
+  }
+  out = putValue(out, keys, 2);
+
+  for (int i = 0; i < DISPLAY_WORDS; i++) {
+    out = putValue(out, chip8->display[i], 8);
+  }
+
+  uint64_t pages = 0;
+  for (int page = 0; page < SNAPSHOT_PAGES; page++) {
+    int offset = page * SNAPSHOT_PAGE_SIZE;
+    if (memcmp(&chip8->memory[offset], &base->memory[offset],
+               SNAPSHOT_PAGE_SIZE)) {
+      pages |= 1ull << page;
+    }
+  }
+  out = putValue(out, pages, 8);
+
+  for (int page = 0; page < SNAPSHOT_PAGES; page++) {
+    if (pages & (1ull << page)) {
+      memcpy(out, &chip8->memory[page * SNAPSHOT_PAGE_SIZE],
+             SNAPSHOT_PAGE_SIZE);
+      out += SNAPSHOT_PAGE_SIZE;
+    }
+  }
+  return out - buffer;
+}
+
+// Restore a snapshot taken by saveState against the same base image.
+// Only bytes that actually change are rewritten, so decoded instructions
+// that are still valid stay cached. Returns false, without touching the
+// machine, if the snapshot is malformed or was taken with a different ROM
+bool loadState(Chip8 *chip8, const BaseImage *base, const uint8_t *buffer,
+               size_t length) {
+  if (length < SNAPSHOT_HEADER_SIZE || memcmp(buffer, "CH8S", 4) ||
+      buffer[4] != SNAPSHOT_VERSION) {
+    return false;
+  }
+
+  const uint8_t *in = buffer + 5;
+  if (getValue(&in, 8) != base->hash) {
+    return false;
+  }
+
+  // The page mask ends the header and says how long the rest should be
+  const uint8_t *mask = buffer + SNAPSHOT_HEADER_SIZE - 8;
+  uint64_t pages = getValue(&mask, 8);
+  size_t expected = SNAPSHOT_HEADER_SIZE;
+  for (int page = 0; page < SNAPSHOT_PAGES; page++) {
+    expected += (pages >> page & 1) * SNAPSHOT_PAGE_SIZE;
+  }
+  if (length != expected || buffer[17] > STACK_SIZE) {
+    return false;
+  }
+
+  chip8->pc = getValue(&in, 2);
+  chip8->index = getValue(&in, 2);
+  chip8->sp = getValue(&in, 1);
+  chip8->delay = getValue(&in, 1);
+  chip8->sound = getValue(&in, 1);
+  chip8->rng = getValue(&in, 4);
+  chip8->clockPhase = getValue(&in, 1) % FRAME_RATE;
+  chip8->hires = getValue(&in, 1) != 0;
+  memcpy(chip8->V, in, sizeof(chip8->V));
+  in += sizeof(chip8->V);
+  for (int i = 0; i < STACK_SIZE; i++) {
+    chip8->stack[i] = getValue(&in, 2);
+  }
+
+  uint16_t keys = getValue(&in, 2);
+  for (int i = 0; i < 0x10; i++) {
+    chip8->keypad[i] = (keys >> i) & 1;
+  }
+
+  for (int i = 0; i < DISPLAY_WORDS; i++) {
+    chip8->display[i] = getValue(&in, 8);
+  }
+  markDisplayChanged(chip8);
+
+  in += 8;
+  for (int page = 0; page < SNAPSHOT_PAGES; page++) {
+    int offset = page * SNAPSHOT_PAGE_SIZE;
+    const uint8_t *source = &base->memory[offset];
+    if (pages & (1ull << page)) {
+      source = in;
+      in += SNAPSHOT_PAGE_SIZE;
+    }
+
+    if (memcmp(&chip8->memory[offset], source, SNAPSHOT_PAGE_SIZE)) {
+      for (int i = 0; i < SNAPSHOT_PAGE_SIZE; i++) {
+        if (chip8->memory[offset + i] != source[i]) {
+          writeMemory(chip8, offset + i, source[i]);
+        }
+      }
+    }
+  }
+  return true;
+}
+
+// Registers as they were at the start of a recorded frame, along with where
+// the pages and rows it changed were saved
+typedef struct RewindFrame {
+  uint16_t pc;
+  uint16_t index;
+  uint16_t stack[STACK_SIZE];
+  uint8_t V[16];
+  uint8_t sp;
+  uint8_t delay;
+  uint8_t sound;
+  uint32_t rng;
+  uint8_t clockPhase;
+  bool hires;
+  uint32_t firstPage; // Position of the frame's first page in the page ring
+  uint32_t firstRow;  // Position of the frame's first row in the row ring
+  uint8_t pageCount;
+  uint8_t rowCount;
+} RewindFrame;
+
+typedef struct RewindPage {
+  uint8_t page;
+  uint8_t bytes[SNAPSHOT_PAGE_SIZE];
+} RewindPage;
+
+typedef struct RewindRow {
+  uint8_t row; // Display word, which is a whole row at low resolution
+  uint64_t pixels;
+} RewindRow;
+
+// Fixed size rings of the last REWIND_FRAMES frames. Each frame only keeps
+// what the memory pages and display rows it dirtied held before it ran, so
+// stepping back a frame undoes it and memory use never grows. Positions
+// count up forever and wrap into the rings, and the oldest frames are dropped
+// when the page or row rings run out of room
+typedef struct Rewind {
+  RewindFrame frames[REWIND_FRAMES];
+  RewindPage pages[REWIND_PAGES];
+  RewindRow rows[REWIND_ROWS];
+  uint32_t oldestFrame;
+  uint32_t nextFrame;
+  uint32_t nextPage;
+  uint32_t nextRow;
+  // The machine as it was at the end of the last recorded frame
+  RewindFrame registers;
+  uint8_t memory[4096];
+  uint64_t display[DISPLAY_WORDS];
+} Rewind;
+
+static void saveRegisters(RewindFrame *frame, const Chip8 *chip8) {
+  frame->pc = chip8->pc;
+  frame->index = chip8->index;
+  memcpy(frame->stack, chip8->stack, sizeof(frame->stack));
+  memcpy(frame->V, chip8->V, sizeof(frame->V));
+  frame->sp = chip8->sp;
+  frame->delay = chip8->delay;
+  frame->sound = chip8->sound;
+  frame->rng = chip8->rng;
+  frame->clockPhase = chip8->clockPhase;
+  frame->hires = chip8->hires;
+}
+
+static void restoreRegisters(Chip8 *chip8, const RewindFrame *frame) {
+  chip8->pc = frame->pc;
+  chip8->index = frame->index;
+  memcpy(chip8->stack, frame->stack, sizeof(frame->stack));
+  memcpy(chip8->V, frame->V, sizeof(frame->V));
+  chip8->sp = frame->sp;
+  chip8->delay = frame->delay;
+  chip8->sound = frame->sound;
+  chip8->rng = frame->rng;
+  chip8->clockPhase = frame->clockPhase;
+  chip8->hires = frame->hires;
+}
+
+void startRewind(Rewind *rewind, Chip8 *chip8) {
+  rewind->oldestFrame = rewind->nextFrame = 0;
+  rewind->nextPage = rewind->nextRow = 0;
+  saveRegisters(&rewind->registers, chip8);
+  memcpy(rewind->memory, chip8->memory, sizeof(rewind->memory));
+  memcpy(rewind->display, chip8->display, sizeof(rewind->display));
+  chip8->dirtyPages = 0;
+  chip8->dirtyWords[0] = chip8->dirtyWords[1] = 0;
+}
+
+// Record the frame that just ran, call once at the end of every frame
+void pushRewindFrame(Rewind *rewind, Chip8 *chip8) {
+  uint8_t pages[SNAPSHOT_PAGES];
+  uint8_t rows[DISPLAY_WORDS];
+  int pageCount = 0;
+  int rowCount = 0;
+
+  // Writes that put back what was already there don't need saving
+  for (int page = 0; page < SNAPSHOT_PAGES; page++) {
+    int offset = page * SNAPSHOT_PAGE_SIZE;
+    if ((chip8->dirtyPages >> page & 1) &&
+        memcmp(&rewind->memory[offset], &chip8->memory[offset],
+               SNAPSHOT_PAGE_SIZE)) {
+      pages[pageCount++] = page;
+    }
+  }
+  for (int row = 0; row < DISPLAY_WORDS; row++) {
+    if ((chip8->dirtyWords[row >> 6] >> (row & 63) & 1) &&
+        rewind->display[row] != chip8->display[row]) {
+      rows[rowCount++] = row;
+    }
+  }
+
+  // Make room by forgetting the oldest frames
+  while (rewind->oldestFrame != rewind->nextFrame) {
+    const RewindFrame *oldest =
+        &rewind->frames[rewind->oldestFrame % REWIND_FRAMES];
+    if (rewind->nextFrame - rewind->oldestFrame < REWIND_FRAMES &&
+        rewind->nextPage + pageCount - oldest->firstPage <= REWIND_PAGES &&
+        rewind->nextRow + rowCount - oldest->firstRow <= REWIND_ROWS) {
+      break;
+    }
+    rewind->oldestFrame++;
+  }
+
+  RewindFrame *frame = &rewind->frames[rewind->nextFrame++ % REWIND_FRAMES];
+  *frame = rewind->registers;
+  frame->firstPage = rewind->nextPage;
+  frame->firstRow = rewind->nextRow;
+  frame->pageCount = pageCount;
+  frame->rowCount = rowCount;
+
+  for (int i = 0; i < pageCount; i++) {
+    int offset = pages[i] * SNAPSHOT_PAGE_SIZE;
+    RewindPage *saved = &rewind->pages[rewind->nextPage++ % REWIND_PAGES];
+    saved->page = pages[i];
+    memcpy(saved->bytes, &rewind->memory[offset], SNAPSHOT_PAGE_SIZE);
+    memcpy(&rewind->memory[offset], &chip8->memory[offset],
+           SNAPSHOT_PAGE_SIZE);
+  }
+  for (int i = 0; i < rowCount; i++) {
+    RewindRow *saved = &rewind->rows[rewind->nextRow++ % REWIND_ROWS];
+    saved->row = rows[i];
+    saved->pixels = rewind->display[rows[i]];
+    rewind->display[rows[i]] = chip8->display[rows[i]];
+  }
+
+  saveRegisters(&rewind->registers, chip8);
+  chip8->dirtyPages = 0;
+  chip8->dirtyWords[0] = chip8->dirtyWords[1] = 0;
+}
+
+// Put the machine back to how it was before the last recorded frame ran.
+// Returns false once there are no frames left to undo
+bool rewindFrame(Rewind *rewind, Chip8 *chip8) {
+  if (rewind->nextFrame == rewind->oldestFrame) {
+    return false;
+  }
+
+  const RewindFrame *frame =
+      &rewind->frames[--rewind->nextFrame % REWIND_FRAMES];
+
+  for (uint32_t i = 0; i < frame->pageCount; i++) {
+    const RewindPage *saved =
+        &rewind->pages[(frame->firstPage + i) % REWIND_PAGES];
+    int offset = saved->page * SNAPSHOT_PAGE_SIZE;
+
+    // Go through writeMemory so decoded instructions get invalidated
+    for (int j = 0; j < SNAPSHOT_PAGE_SIZE; j++) {
+      if (chip8->memory[offset + j] != saved->bytes[j]) {
+        writeMemory(chip8, offset + j, saved->bytes[j]);
+      }
+    }
+    memcpy(&rewind->memory[offset], saved->bytes, SNAPSHOT_PAGE_SIZE);
+  }
+  for (uint32_t i = 0; i < frame->rowCount; i++) {
+    const RewindRow *saved =
+        &rewind->rows[(frame->firstRow + i) % REWIND_ROWS];
+    chip8->display[saved->row] = saved->pixels;
+    rewind->display[saved->row] = saved->pixels;
+  }
+  chip8->displayDirty = true;
+
+  restoreRegisters(chip8, frame);
+  chip8->trap.code = TRAP_NONE;
+  rewind->registers = *frame;
+  rewind->nextPage = frame->firstPage;
+  rewind->nextRow = frame->firstRow;
+  chip8->dirtyPages = 0;
+  chip8->dirtyWords[0] = chip8->dirtyWords[1] = 0;
+  return true;
+}
+
+size_t readStateFile(const char *filePath, uint8_t *buffer) {
+  FILE *stateFile = fopen(filePath, "rb");
+  if (stateFile == NULL) {
+    fprintf(stderr, "Could not open %s\n", filePath);
+    exit(EXIT_FAILURE);
+  }
+
+  size_t length = fread(buffer, 1, MAX_SNAPSHOT_SIZE, stateFile);
+  fclose(stateFile);
+  return length;
+}
+
+void writeStateFile(const char *filePath, const uint8_t *buffer,
+                    size_t length) {
+  FILE *stateFile = fopen(filePath, "wb");
+  if (stateFile == NULL || fwrite(buffer, length, 1, stateFile) != 1) {
+    fprintf(stderr, "Could not write %s\n", filePath);
+    exit(EXIT_FAILURE);
+  }
+  fclose(stateFile);
+}
+
+// Input logs start with a header holding the random seed, clock speed and
+// quirks of the machine, followed by one entry per keypad change. Each
+// entry is a varint of the frames since the previous entry shifted up by
+// one, a varint of the cycles into the frame it happened at, then the new
+// keypad bitmask in two bytes. A first varint with the low bit set marks
+// the end of the session and has nothing after it
+typedef struct Recording {
+  FILE *file;
+  long frame; // Frame of the last entry written
+  Uint32 keys;
+} Recording;
+
+typedef struct Replay {
+  uint8_t *data;
+  size_t size;
+  size_t position;
+  long nextFrame; // Frame the next change applies in
+  KeyChange next;
+  long length; // Frames in the session, or -1 if it never ended cleanly
+} Replay;
+
+static void putVarint(FILE *file, unsigned long value) {
+  do {
+    uint8_t byte = (value & 0x7F) | (value > 0x7F ? 0x80 : 0);
+    fputc(byte, file);
+    value >>= 7;
+  } while (value);
+}
+
+void startRecording(Recording *recording, const char *filePath,
+                    const Chip8 *chip8) {
+  recording->file = fopen(filePath, "wb");
+  if (recording->file == NULL) {
+    fprintf(stderr, "Could not write %s\n", filePath);
+    exit(EXIT_FAILURE);
+  }
+  recording->frame = 0;
+  recording->keys = 0;
+
+  uint8_t header[INPUT_LOG_HEADER_SIZE] = {'C', 'H', '8', 'I',
+                                           INPUT_LOG_VERSION};
+  uint8_t *out = putValue(&header[5], chip8->rng, 4);
+  out = putValue(out, chip8->clockSpeed, 4);
+  putValue(out, chip8->quirks, 1);
+  fwrite(header, sizeof(header), 1, recording->file);
+}
+
+// Log a change to the keys held if it is one the keypad can see
+void recordKeys(Recording *recording, long frame, const KeyChange *change) {
+  Uint32 keys = change->keys & 0xFFFF;
+  if (keys == recording->keys) {
+    return;
+  }
+
+  putVarint(recording->file, (unsigned long)(frame - recording->frame) << 1);
+  putVarint(recording->file, change->cycle);
+  fputc(keys & 0xFF, recording->file);
+  fputc(keys >> 8, recording->file);
+  recording->frame = frame;
+  recording->keys = keys;
+}
+
+void stopRecording(Recording *recording, long frames) {
+  putVarint(recording->file,
+            (unsigned long)(frames - recording->frame) << 1 | 1);
+  if (ferror(recording->file) | fclose(recording->file)) {
+    fprintf(stderr, "Could not finish writing the input log\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static bool readVarint(Replay *replay, unsigned long *value) {
+  int shift = 0;
+  uint8_t byte;
+
+  *value = 0;
+  do {
+    if (replay->position >= replay->size || shift > 56) {
+      return false;
+    }
+    byte = replay->data[replay->position++];
+    *value |= (unsigned long)(byte & 0x7F) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  return true;
+}
+
+// Read the next change, returning false at the end of the log
+static bool readEntry(Replay *replay) {
+  unsigned long frames;
+  unsigned long cycle;
+
+  if (!readVarint(replay, &frames)) {
+    return false;
+  }
+  if (frames & 1) {
+    replay->length = replay->nextFrame + (long)(frames >> 1);
+    return false;
+  }
+  if (!readVarint(replay, &cycle) || replay->size - replay->position < 2) {
+    return false;
+  }
+  replay->nextFrame += frames >> 1;
+  replay->next.cycle = cycle;
+  replay->next.keys = replay->data[replay->position] |
+                      replay->data[replay->position + 1] << 8;
+  replay->position += 2;
+  return true;
+}
+
+static void restartReplay(Replay *replay) {
+  replay->position = INPUT_LOG_HEADER_SIZE;
+  replay->nextFrame = 0;
+  if (!readEntry(replay)) {
+    replay->nextFrame = LONG_MAX;
+  }
+}
+
+// Load a whole log and set the machine up the way the recorded session was
+void startReplay(Replay *replay, const char *filePath, Chip8 *chip8) {
+  FILE *logFile = fopen(filePath, "rb");
+  if (logFile == NULL) {
+    fprintf(stderr, "Could not open %s\n", filePath);
+    exit(EXIT_FAILURE);
+  }
+
+  fseek(logFile, 0, SEEK_END);
+  long size = ftell(logFile);
+  fseek(logFile, 0, SEEK_SET);
+  replay->data = malloc(size > 0 ? size : 1);
+  if (replay->data == NULL || size < INPUT_LOG_HEADER_SIZE ||
+      fread(replay->data, size, 1, logFile) != 1 ||
+      memcmp(replay->data, "CH8I", 4) != 0 ||
+      replay->data[4] != INPUT_LOG_VERSION) {
+    fprintf(stderr, "%s is not an input log\n", filePath);
+    exit(EXIT_FAILURE);
+  }
+  fclose(logFile);
+  replay->size = size;
+
+  // Nothing has been decoded yet, so the quirks can still change
+  const uint8_t *in = &replay->data[5];
+  chip8->rng = getValue(&in, 4);
+  chip8->clockSpeed = getValue(&in, 4);
+  chip8->quirks = getValue(&in, 1);
+
+  // Find out how long the session was before playing it from the start
+  replay->length = -1;
+  restartReplay(replay);
+  while (readEntry(replay)) {
+  }
+  restartReplay(replay);
+}
+
+// Get the changes recorded in a frame, for frames in increasing order
+int replayChanges(Replay *replay, long frame, KeyChange *changes, int max) {
+  int count = 0;
+
+  while (replay->nextFrame <= frame && count < max) {
+    changes[count] = replay->next;
+    // Anything left over from an earlier frame happens at its start
+    if (replay->nextFrame < frame) {
+      changes[count].cycle = 0;
+    }
+    count++;
+    if (!readEntry(replay)) {
+      replay->nextFrame = LONG_MAX;
+    }
+  }
+  return count;
+}
+
+int formatState(const Chip8 *chip8, char *buffer, size_t size) {
+  int length = snprintf(
+      buffer, size, "pc: 0x%04x index: 0x%04x sp: %d delay: %d sound: %d\nV:",
+      chip8->pc, chip8->index, chip8->sp, chip8->delay, chip8->sound);
+  for (int i = 0; i < 0x10; i++) {
+    length += snprintf(buffer + length, size - length, " %02x", chip8->V[i]);
+  }
+  length += snprintf(buffer + length, size - length, "\ndisplay: 0x%016llx\n",
+                     (unsigned long long)hashDisplay(chip8));
+  if (chip8->trap.code != TRAP_NONE) {
+    length += snprintf(buffer + length, size - length,
+                       "trap: %s 0x%04x at 0x%04x\n",
+                       trapNames[chip8->trap.code], chip8->trap.opcode,
+                       chip8->trap.pc);
+  }
+  return length;
+}
+
+// Run the cpu as fast as possible without SDL, ticking the timers once a
+// frame as if frames were being drawn, then write a report of the final
+// state. A replay feeds in the recorded keys and, unless told otherwise,
+// runs for as long as the recorded session did
+void runHeadless(Chip8 *chip8, Replay *replay, char *report, size_t size) {
+  long totalFrames = frameBudget;
+  if (replay && replay->length >= 0) {
+    totalFrames = replay->length;
+  }
+  long totalCycles =
+      cycleBudget > 0
+          ? cycleBudget
+          : (chip8->clockPhase + totalFrames * chip8->clockSpeed) / FRAME_RATE;
+  long frames = 0;
+
+  for (long remaining = totalCycles; remaining > 0;) {
+    KeyChange changes[MAX_FRAME_CHANGES];
+    int count =
+        replay ? replayChanges(replay, frames, changes, MAX_FRAME_CHANGES) : 0;
+
+    // Only whole frames tick the timers
+    long cycles = frameCycles(chip8);
+    if (remaining < cycles) {
+      runCyclesWithKeys(chip8, remaining, changes, count);
+      break;
+    }
+    remaining -= cycles;
+
+    if (runCyclesWithKeys(chip8, cycles, changes, count) == STOP_TRAP) {
+      break;
+    }
+    updateTimers(chip8);
+    frames++;
+  }
+
+  int length =
+      snprintf(report, size, "cycles: %ld frames: %ld\n", totalCycles, frames);
+  formatState(chip8, report + length, size - length);
+}
+
+// Breakpoints and watches for the debugger. It steps the machine in its own
+// loop and checks these around every instruction, so nothing else pays for
+// them
+typedef struct Debugger {
+  uint64_t breakpoints[4096 / 64]; // Addresses to stop before running
+  uint64_t watches[4096 / 64];     // Memory to stop after writes to
+  uint32_t registerWatches;        // Bit per V register, and 16 for index
+  long frameLeft;                  // Cycles left in the current frame
+  long frames;                     // Frames since the debugger started
+} Debugger;
+
+static bool testAddress(const uint64_t *set, uint16_t address) {
+  address &= 0xFFF;
+  return set[address / 64] >> (address % 64) & 1;
+}
+
+static void setAddress(uint64_t *set, uint16_t address, bool value) {
+  address &= 0xFFF;
+  if (value) {
+    set[address / 64] |= 1ull << (address % 64);
+  } else {
+    set[address / 64] &= ~(1ull << (address % 64));
+  }
+}
+
+// Set by ctrl-c so a continue that never hits anything can be broken into
+static volatile sig_atomic_t debugInterrupted = false;
+
+static void interruptDebugger(int signal) {
+  (void)signal;
+  debugInterrupted = true;
+}
+
+static void printInstruction(Chip8 *chip8, uint16_t address) {
+  const Instruction *instruction = fetch(chip8, address);
+  printf("0x%04x: %04x  %s\n", address & 0xFFF, instruction->opcode,
+         handlerNames[handlerIndex(instruction->execute)].pattern);
+}
+
+// The bytes an instruction is about to write, if it writes any
+static int writtenRange(const Chip8 *chip8, const Instruction *in,
+                        uint16_t *first) {
+  Handler execute = in->execute;
+
+  *first = chip8->index;
+  if (execute == xFX33) {
+    return 3;
+  }
+  if (execute == xFX55 || execute == xFX55Index || execute == xFX55IndexX) {
+    return in->X + 1;
+  }
+  return 0;
+}
+
+// Run one instruction exactly as runFrame would have, ending the frame when
+// its cycles run out or the cpu stops early. Returns true if a watch fired
+static bool debugStep(Chip8 *chip8, Debugger *debugger, StopReason *stop) {
+  const Instruction *in = fetch(chip8, chip8->pc);
+  uint16_t first;
+  int length = writtenRange(chip8, in, &first);
+  uint8_t V[16];
+  uint16_t index = chip8->index;
+  bool fired = false;
+
+  memcpy(V, chip8->V, sizeof(V));
+  if (debugger->frameLeft == 0) {
+    debugger->frameLeft = frameCycles(chip8);
+  }
+  *stop = runCycles(chip8, 1);
+  if (*stop == STOP_TRAP) {
+    return false;
+  }
+  debugger->frameLeft--;
+  if (*stop != STOP_BUDGET || debugger->frameLeft == 0) {
+    updateTimers(chip8);
+    debugger->frameLeft = 0;
+    debugger->frames++;
+  }
+
+  for (int i = 0; i < length; i++) {
+    uint16_t address = (first + i) & 0xFFF;
+    if (testAddress(debugger->watches, address)) {
+      printf("watch: 0x%04x = %02x\n", address, chip8->memory[address]);
+      fired = true;
+    }
+  }
+  for (int i = 0; i < 16; i++) {
+    if ((debugger->registerWatches >> i & 1) && V[i] != chip8->V[i]) {
+      printf("watch: V%X %02x -> %02x\n", i, V[i], chip8->V[i]);
+      fired = true;
+    }
+  }
+  if ((debugger->registerWatches >> 16 & 1) && index != chip8->index) {
+    printf("watch: index 0x%04x -> 0x%04x\n", index, chip8->index);
+    fired = true;
+  }
+  return fired;
+}
+
+// Run until something worth stopping for. A breakpoint where the cpu already
+// is doesn't count, so continuing from one moves past it
+static void debugRun(Chip8 *chip8, Debugger *debugger, long steps,
+                     bool breakpoints) {
+  debugInterrupted = false;
+  for (long i = 0; i < steps; i++) {
+    if (debugInterrupted) {
+      printf("interrupted\n");
+      break;
+    }
+    if (breakpoints && i > 0 && testAddress(debugger->breakpoints, chip8->pc)) {
+      printf("breakpoint\n");
+      break;
+    }
+
+    StopReason stop;
+    bool fired = debugStep(chip8, debugger, &stop);
+    if (stop == STOP_TRAP) {
+      printf("trap: %s 0x%04x at 0x%04x\n", trapNames[chip8->trap.code],
+             chip8->trap.opcode, chip8->trap.pc);
+      break;
+    }
+    if (fired) {
+      break;
+    }
+  }
+  printInstruction(chip8, chip8->pc);
+}
+
+// Watch V0-VF or the index by name, otherwise a range of memory
+static bool setWatch(Debugger *debugger, const char *target, long length,
+                     bool value) {
+  uint32_t bit = 0;
+  if ((target[0] == 'V' || target[0] == 'v') && target[1] != '\0' &&
+      target[2] == '\0' && isxdigit((unsigned char)target[1])) {
+    bit = 1u << strtol(&target[1], NULL, 16);
+  } else if (strcmp(target, "I") == 0 || strcmp(target, "index") == 0) {
+    bit = 1u << 16;
+  }
+  if (bit) {
+    debugger->registerWatches =
+        value ? debugger->registerWatches | bit
+              : debugger->registerWatches & ~bit;
+    return true;
+  }
+
+  char *end;
+  long address = strtol(target, &end, 16);
+  if (*end != '\0') {
+    return false;
+  }
+  for (long i = 0; i < length; i++) {
+    setAddress(debugger->watches, address + i, value);
+  }
+  return true;
+}
+
+static const char *debuggerHelp =
+    "break ADDRESS       stop before running the instruction at ADDRESS\n"
+    "delete ADDRESS      remove a breakpoint\n"
+    "watch TARGET [N]    stop after writes to N bytes of memory from TARGET,\n"
+    "                    or after changes to V0-VF or I\n"
+    "unwatch TARGET [N]  remove a watch\n"
+    "step [N]            run N instructions, ignoring breakpoints\n"
+    "continue            run until a breakpoint, watch or trap\n"
+    "registers           show the registers\n"
+    "stack               show the call stack\n"
+    "memory ADDRESS [N]  show N bytes of memory\n"
+    "keys MASK           hold the keys in a hex bitmask\n"
+    "quit\n"
+    "Addresses and masks are hex, and an empty line repeats the last "
+    "command\n";
+
+// An interactive debugger on stdin and stdout. The machine runs frame by
+// frame as it would headless, with timers ticking at the end of each frame
+void runDebugger(Chip8 *chip8) {
+  static Debugger debugger;
+  char line[256];
+  char last[256] = "";
+
+  chip8->blockCache = false;
+  signal(SIGINT, interruptDebugger);
+  printInstruction(chip8, chip8->pc);
+  for (;;) {
+    printf("(chip8) ");
+    fflush(stdout);
+    if (fgets(line, sizeof(line), stdin) == NULL) {
+      break;
+    }
+    if (line[0] == '\n') {
+      strcpy(line, last);
+    } else {
+      strcpy(last, line);
+    }
+
+    char command[32] = "";
+    char first[64] = "";
+    char second[64] = "";
+    sscanf(line, "%31s %63s %63s", command, first, second);
+    long count = second[0] ? strtol(second, NULL, 10) : 1;
+
+    if (command[0] == '\0') {
+      continue;
+    } else if (!strcmp(command, "break") || !strcmp(command, "b")) {
+      setAddress(debugger.breakpoints, strtol(first, NULL, 16), true);
+    } else if (!strcmp(command, "delete") || !strcmp(command, "d")) {
+      setAddress(debugger.breakpoints, strtol(first, NULL, 16), false);
+    } else if (!strcmp(command, "watch") || !strcmp(command, "w") ||
+               !strcmp(command, "unwatch")) {
+      if (!setWatch(&debugger, first, count, command[0] != 'u')) {
+        printf("Can't watch %s\n", first);
+      }
+    } else if (!strcmp(command, "step") || !strcmp(command, "s")) {
+      debugRun(chip8, &debugger, first[0] ? strtol(first, NULL, 10) : 1,
+               false);
+    } else if (!strcmp(command, "continue") || !strcmp(command, "c")) {
+      debugRun(chip8, &debugger, LONG_MAX, true);
+    } else if (!strcmp(command, "registers") || !strcmp(command, "r")) {
+      char report[REPORT_SIZE];
+      formatState(chip8, report, sizeof(report));
+      printf("frames: %ld\n%s", debugger.frames, report);
+    } else if (!strcmp(command, "stack")) {
+      for (int i = chip8->sp - 1; i >= 0; i--) {
+        printf("#%d 0x%04x\n", i, chip8->stack[i]);
+      }
+    } else if (!strcmp(command, "memory") || !strcmp(command, "x")) {
+      long address = strtol(first, NULL, 16);
+      for (long i = 0; i < count; i++) {
+        if (i % 16 == 0) {
+          printf("%s0x%04lx:", i ? "\n" : "", (address + i) & 0xFFF);
+        }
+        printf(" %02x", chip8->memory[(address + i) & 0xFFF]);
+      }
+      printf("\n");
+    } else if (!strcmp(command, "keys") || !strcmp(command, "k")) {
+      setKeypad(chip8, strtoul(first, NULL, 16));
+    } else if (!strcmp(command, "quit") || !strcmp(command, "q")) {
+      break;
+    } else {
+      printf("%s", debuggerHelp);
+    }
+  }
+}
+
+// What static analysis found at each address of a ROM
+enum {
+  ANALYSIS_CODE = 1 << 0,          // An instruction starts here
+  ANALYSIS_LEADER = 1 << 1,        // A basic block starts here
+  ANALYSIS_DATA = 1 << 2,          // Read as a sprite or by FX65
+  ANALYSIS_WRITTEN = 1 << 3,       // Written by FX33 or FX55
+  ANALYSIS_UNKNOWN_WRITE = 1 << 4, // Writes through an index we lost track of
+  ANALYSIS_INDIRECT = 1 << 5,      // BNNN, whose target depends on a register
+  ANALYSIS_UNRECOGNISED = 1 << 6,  // Traps if it's ever run
+};
+
+// The index reaching an address, if it's the same on every path there
+#define INDEX_UNSEEN -1
+#define INDEX_VARIES -2
+
+typedef struct Analysis {
+  uint8_t flags[4096];
+  int32_t index[4096];
+  uint16_t work[2 * 4096 + 1]; // An address is queued at most twice
+  int queued;
+} Analysis;
+
+// Where control can go after an instruction, and so where blocks end
+static int successors(const Instruction *in, uint16_t address,
+                      uint16_t *next) {
+  Handler execute = in->execute;
+
+  if (execute == nop || execute == x00EE || execute == xBNNN ||
+      execute == xBXNN) {
+    return 0;
+  }
+  if (execute == x1NNN) {
+    next[0] = in->NNN;
+    return 1;
+  }
+  if (execute == x2NNN) {
+    next[0] = in->NNN;
+    next[1] = (address + 2) & 0xFFF;
+    return 2;
+  }
+  next[0] = (address + 2) & 0xFFF;
+  if (execute == x3XNN || execute == x4XNN || execute == x5XY0 ||
+      execute == x9XY0 || execute == xEX9E || execute == xEXA1) {
+    next[1] = (address + 4) & 0xFFF;
+    return 2;
+  }
+  return 1;
+}
+
+static void markRange(Analysis *analysis, int32_t index, int length,
+                      uint8_t flag) {
+  for (int i = 0; i < length; i++) {
+    analysis->flags[(index + i) & 0xFFF] |= flag;
+  }
+}
+
+// Queue an address with the index that reaches it from one path
+static void reach(Analysis *analysis, uint16_t address, int32_t index) {
+  int32_t seen = analysis->index[address];
+  int32_t merged = seen == INDEX_UNSEEN || seen == index ? index : INDEX_VARIES;
+
+  if (merged != seen) {
+    analysis->index[address] = merged;
+    analysis->work[analysis->queued++] = address;
+  }
+}
+
+// Follow every path from the entry point without running anything, tracking
+// the index where it's a constant so sprite reads and stores can be placed
+void analyzeProgram(const Chip8 *chip8, uint16_t entry, Analysis *analysis) {
+  memset(analysis->flags, 0, sizeof(analysis->flags));
+  for (int i = 0; i < 4096; i++) {
+    analysis->index[i] = INDEX_UNSEEN;
+  }
+  analysis->queued = 0;
+  analysis->flags[entry & 0xFFF] |= ANALYSIS_LEADER;
+  reach(analysis, entry & 0xFFF, INDEX_VARIES);
+
+  while (analysis->queued > 0) {
+    uint16_t address = analysis->work[--analysis->queued];
+    int32_t index = analysis->index[address];
+    Instruction in =
+        decode(chip8->memory[address] << 8 |
+                   chip8->memory[(address + 1) & 0xFFF],
+               chip8->quirks);
+    Handler execute = in.execute;
+    bool known = index != INDEX_VARIES;
+    uint8_t *flags = &analysis->flags[address];
+
+    *flags |= ANALYSIS_CODE;
+    if (execute == nop) {
+      *flags |= ANALYSIS_UNRECOGNISED;
+    } else if (execute == xBNNN || execute == xBXNN) {
+      *flags |= ANALYSIS_INDIRECT;
+    }
+
+    // Work out what the instruction touches and where it leaves the index
+    int length = 0;
+    uint8_t touched = 0;
+    int shift = 0;
+    if (execute == xANNN) {
+      index = in.NNN;
+    } else if (execute == xFX1E || execute == xFX29) {
+      index = INDEX_VARIES;
+    } else if (execute == xDXYN || execute == xDXYNWait) {
+      length = in.N;
+      touched = ANALYSIS_DATA;
+    } else if (execute == xDXY0 || execute == xDXY0Hires) {
+      length = 32;
+      touched = ANALYSIS_DATA;
+    } else if (execute == xFX33) {
+      length = 3;
+      touched = ANALYSIS_WRITTEN;
+    } else if (execute == xFX55 || execute == xFX55Index ||
+               execute == xFX55IndexX || execute == xFX65 ||
+               execute == xFX65Index || execute == xFX65IndexX) {
+      bool store = execute == xFX55 || execute == xFX55Index ||
+                   execute == xFX55IndexX;
+      length = in.X + 1;
+      touched = store ? ANALYSIS_WRITTEN : ANALYSIS_DATA;
+      shift = execute == xFX55Index || execute == xFX65Index ? in.X + 1
+              : execute == xFX55IndexX || execute == xFX65IndexX ? in.X
+                                                                 : 0;
+    }
+    if (length > 0 && known) {
+      markRange(analysis, index, length, touched);
+    } else if (touched == ANALYSIS_WRITTEN) {
+      *flags |= ANALYSIS_UNKNOWN_WRITE;
+    }
+    if (known) {
+      index = (index + shift) & 0xFFFF;
+    }
+
+    uint16_t next[2];
+    int count = successors(&in, address, next);
+    for (int i = 0; i < count; i++) {
+      // Anything other than falling through starts a new block, and a call
+      // can come back with any index
+      bool call = execute == x2NNN && i == 1;
+      if (count > 1 || execute == x1NNN || execute == x2NNN) {
+        analysis->flags[next[i]] |= ANALYSIS_LEADER;
+      }
+      reach(analysis, next[i], call ? INDEX_VARIES : index);
+    }
+  }
+}
+
+// Print each run of addresses with a flag as one range
+static void printRanges(const Analysis *analysis, uint8_t flag,
+                        uint8_t also, const char *label) {
+  for (int start = 0; start < 4096;) {
+    if (!(analysis->flags[start] & flag) ||
+        (also && !(analysis->flags[start] & also))) {
+      start++;
+      continue;
+    }
+    int end = start;
+    while (end + 1 < 4096 && analysis->flags[end + 1] & flag &&
+           (!also || analysis->flags[end + 1] & also)) {
+      end++;
+    }
+    printf("%s 0x%04x-0x%04x\n", label, start, end);
+    start = end + 1;
+  }
+}
+
+// Disassemble every reachable instruction into basic blocks with their
+// successors, then list the data and self-modifying regions. Fails if any
+// path reaches an opcode that would trap
+bool analyzeROM(const Chip8 *chip8) {
+  static Analysis analysis;
+  int instructions = 0;
+  int blocks = 0;
+  bool clean = true;
+
+  analyzeProgram(chip8, chip8->pc, &analysis);
+
+  for (int start = 0; start < 4096; start++) {
+    if (!(analysis.flags[start] & ANALYSIS_LEADER)) {
+      continue;
+    }
+
+    // A block runs until something branches or another block starts
+    uint16_t address = start;
+    uint16_t next[2];
+    int count;
+    printf("block 0x%04x\n", start);
+    blocks++;
+    for (;;) {
+      uint16_t opcode = chip8->memory[address] << 8 |
+                        chip8->memory[(address + 1) & 0xFFF];
+      Instruction in = decode(opcode, chip8->quirks);
+      printf("  0x%04x: %04x  %s\n", address, opcode,
+             handlerNames[handlerIndex(in.execute)].pattern);
+      instructions++;
+      count = successors(&in, address, next);
+      if (count != 1 || in.execute == x1NNN ||
+          analysis.flags[next[0]] & ANALYSIS_LEADER) {
+        break;
+      }
+      address = next[0];
+    }
+    printf("  ->");
+    for (int i = 0; i < count; i++) {
+      printf(" 0x%04x", next[i]);
+    }
+    printf(count == 0 ? " none\n" : "\n");
+  }
+  printf("%d instructions in %d blocks\n", instructions, blocks);
+
+  printRanges(&analysis, ANALYSIS_DATA, 0, "data");
+  printRanges(&analysis, ANALYSIS_WRITTEN, 0, "written");
+  for (int address = 0; address < 4096; address++) {
+    uint8_t flags = analysis.flags[address];
+
+    // Writes to either byte of an instruction change it
+    if (flags & ANALYSIS_CODE &&
+        (flags | analysis.flags[(address + 1) & 0xFFF]) & ANALYSIS_WRITTEN) {
+      printf("self-modifying 0x%04x\n", address);
+    }
+    if (flags & ANALYSIS_UNKNOWN_WRITE) {
+      printf("write through an unknown index at 0x%04x\n", address);
+    }
+    if (flags & ANALYSIS_INDIRECT) {
+      printf("indirect jump at 0x%04x\n", address);
+    }
+    if (flags & ANALYSIS_UNRECOGNISED) {
+      printf("unrecognised opcode 0x%04x at 0x%04x\n",
+             chip8->memory[address] << 8 |
+                 chip8->memory[(address + 1) & 0xFFF],
+             address);
+      clean = false;
+    }
+  }
+  return clean;
+}
+
+// Write one basic block as a C function that calls each instruction's
+// handler directly, setting pc and the opcode as cpuCycle would first, and
+// stops after however many instructions it's told to run. Returns how many
+// instructions it has, or 0 if it can't be compiled
+static int compileBlockSource(FILE *out, Chip8 *chip8, Analysis *analysis,
+                              uint16_t start) {
+  int length = 0;
+  uint16_t address = start;
+
+  // Code that the ROM writes over is left to the interpreter
+  for (;;) {
+    const Instruction *in = fetch(chip8, address);
+    if ((analysis->flags[address] |
+         analysis->flags[(address + 1) & 0xFFF]) &
+        ANALYSIS_WRITTEN) {
+      return 0;
+    }
+    length++;
+    if (endsBlock(in) || address + 2 >= 0xFFF ||
+        analysis->flags[address + 2] & ANALYSIS_LEADER) {
+      break;
+    }
+
+    // Long runs are split with the rest compiled as a block of its own
+    if (length == MAX_BLOCK_LENGTH) {
+      analysis->flags[address + 2] |= ANALYSIS_LEADER;
+      break;
+    }
+    address += 2;
+  }
+
+  fprintf(out, "\nstatic const Instruction instructions%04x[] = {\n", start);
+  for (int i = 0; i < length; i++) {
+    const Instruction *in = fetch(chip8, start + i * 2);
+    fprintf(out, "    {%s, 0x%04x, 0x%03x, %d, %d, %d, 0x%02x},\n",
+            handlerNames[handlerIndex(in->execute)].name, in->opcode, in->NNN,
+            in->X, in->Y, in->N, in->NN);
+  }
+  fprintf(out, "};\n\nstatic void block%04x(Chip8 *chip8, int length) {\n",
+          start);
+  for (int i = 0; i < length; i++) {
+    const Instruction *in = fetch(chip8, start + i * 2);
+    fprintf(out,
+            "  chip8->opcode = 0x%04x;\n"
+            "  chip8->pc = 0x%04x;\n"
+            "  %s(chip8, &instructions%04x[%d]);\n"
+            "  PROFILE_INSTRUCTION(chip8, &instructions%04x[%d], 0x%04x);\n",
+            in->opcode, start + i * 2 + 2,
+            handlerNames[handlerIndex(in->execute)].name, start, i, start, i,
+            start + i * 2);
+    if (i + 1 < length) {
+      fprintf(out, "  if (--length == 0) {\n"
+                   "    return;\n"
+                   "  }\n");
+    }
+  }
+  fprintf(out, "}\n");
+  return length;
+}
+
+// Translate a ROM ahead of time into a C file with a function for each basic
+// block the analyzer can reach. Building that file in place of this one
+// gives an emulator that runs the ROM through those functions, and anything
+// else through the interpreter
+void compileROM(Chip8 *chip8, const char *romPath, const char *path) {
+  static Analysis analysis;
+  static int lengths[4096];
+  FILE *out = fopen(path, "w");
+
+  if (out == NULL) {
+    fprintf(stderr, "Could not open %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  size_t size = sizeof(chip8->memory) - 0x200;
+  while (size > 0 && chip8->memory[0x200 + size - 1] == 0) {
+    size--;
+  }
+
+  fprintf(out,
+          "// Generated by chip8 --compile from %s. Build this instead of\n"
+          "// main.c with main.c on the include path\n"
+          "#define CHIP8_AOT\n"
+          "#include \"main.c\"\n\n"
+          "const uint8_t compiledQuirks = 0x%02x;\n"
+          "const size_t compiledROMSize = %zu;\n"
+          "const uint8_t compiledROM[] = {",
+          romPath, chip8->quirks, size);
+  for (size_t i = 0; i < size; i++) {
+    fprintf(out, i % 12 == 0 ? "\n    0x%02x," : " 0x%02x,",
+            chip8->memory[0x200 + i]);
+  }
+  fprintf(out, "\n};\n");
+
+  analyzeProgram(chip8, chip8->pc, &analysis);
+  for (int start = 0; start < 4096; start++) {
+    if (analysis.flags[start] & ANALYSIS_LEADER) {
+      lengths[start] = compileBlockSource(out, chip8, &analysis, start);
+    }
+  }
+
+  // Dispatch on the exact pc so a block only runs from where it was compiled
+  fprintf(out, "\nbool runCompiledBlock(Chip8 *chip8) {\n"
+               "  int length;\n"
+               "\n"
+               "  switch (chip8->pc) {\n");
+  for (int start = 0; start < 4096; start++) {
+    if (lengths[start] == 0) {
+      continue;
+    }
+    uint64_t pages = 0;
+    for (int i = start; i <= start + lengths[start] * 2 - 1; i++) {
+      pages |= 1ull << (i / SNAPSHOT_PAGE_SIZE);
+    }
+    fprintf(out,
+            "  case 0x%04x:\n"
+            "    length = enterCompiledBlock(chip8, 0x%016" PRIx64 "ull, %d);\n"
+            "    if (length == 0) {\n"
+            "      return false;\n"
+            "    }\n"
+            "    block%04x(chip8, length);\n"
+            "    return true;\n",
+            start, pages, lengths[start], start);
+  }
+  fprintf(out, "  }\n  return false;\n}\n");
+  fclose(out);
+}
+
+// Many machines running the same ROM in lockstep, with each register laid out
+// as an array across the lanes so an instruction can be applied to all of
+// them with one loop the compiler can vectorise
+typedef struct Chip8Lanes {
+  uint8_t memory[LANES][4096];
+  uint64_t display[DISPLAY_WORDS][LANES];
+  uint8_t keypad[16][LANES];
+  uint8_t V[16][LANES];
+  uint16_t stack[STACK_SIZE][LANES];
+  uint8_t sp[LANES];
+  uint8_t delay[LANES];
+  uint8_t sound[LANES];
+  uint16_t pc[LANES];
+  uint16_t index[LANES];
+  uint32_t rng[LANES];
+  long remaining[LANES]; // Cycles each lane has left in the current batch
+  uint8_t trap[LANES];   // TrapCode of lanes that have stopped
+  uint16_t trapOpcode[LANES];
+  bool hires[LANES];
+  uint8_t quirks; // Shared by every lane
+  int clockSpeed;
+} Chip8Lanes;
+
+// Start every lane from a machine that has already been set up, giving each
+// one its own random number generator seed
+void setupLanes(Chip8Lanes *lanes, const Chip8 *chip8) {
+  memset(lanes, 0, sizeof(*lanes));
+
+  lanes->quirks = chip8->quirks;
+  lanes->clockSpeed = chip8->clockSpeed;
+  for (int l = 0; l < LANES; l++) {
+    memcpy(lanes->memory[l], chip8->memory, sizeof(chip8->memory));
+    for (int i = 0; i < DISPLAY_WORDS; i++) {
+      lanes->display[i][l] = chip8->display[i];
+    }
+    lanes->hires[l] = chip8->hires;
+    lanes->pc[l] = chip8->pc;
+    // The first lane carries on exactly like the machine it was copied from
+    lanes->rng[l] = l == 0 ? chip8->rng : mixSeed(chip8->rng, l);
+  }
+}
+
+// Copy a single lane out into a normal machine
+void copyLane(const Chip8Lanes *lanes, int l, Chip8 *chip8) {
+  memset(chip8, 0, sizeof(*chip8));
+
+  memcpy(chip8->memory, lanes->memory[l], sizeof(chip8->memory));
+  for (int i = 0; i < DISPLAY_WORDS; i++) {
+    chip8->display[i] = lanes->display[i][l];
+  }
+  chip8->hires = lanes->hires[l];
+  for (int i = 0; i < 16; i++) {
+    chip8->keypad[i] = lanes->keypad[i][l];
+    chip8->V[i] = lanes->V[i][l];
+  }
+  for (int i = 0; i < STACK_SIZE; i++) {
+    chip8->stack[i] = lanes->stack[i][l];
+  }
+  chip8->sp = lanes->sp[l];
+  chip8->delay = lanes->delay[l];
+  chip8->sound = lanes->sound[l];
+  chip8->pc = lanes->pc[l];
+  chip8->index = lanes->index[l];
+  chip8->rng = lanes->rng[l];
+  chip8->quirks = lanes->quirks;
+  chip8->clockSpeed = lanes->clockSpeed;
+  chip8->trap = (Trap){.code = lanes->trap[l],
+                       .pc = lanes->pc[l],
+                       .opcode = lanes->trapOpcode[l]};
+  chip8->displayDirty = true;
+}
+
+static uint16_t laneOpcode(const Chip8Lanes *lanes, int l, uint16_t pc) {
+  return lanes->memory[l][pc & 0xFFF] << 8 |
+         lanes->memory[l][(pc + 1) & 0xFFF];
+}
+
+// Stop a lane on the instruction it is executing, like raiseTrap
+static void trapLane(Chip8Lanes *lanes, int l, TrapCode code,
+                     uint16_t opcode) {
+  lanes->pc[l] -= 2;
+  lanes->trap[l] = code;
+  lanes->trapOpcode[l] = opcode;
+  lanes->remaining[l] = 0;
+}
+
+// Execute one instruction on every lane that is at the same point as the lane
+// furthest behind, the others are masked off until the leader reaches them
+// or they get their own turn
+bool stepLanes(Chip8Lanes *lanes) {
+  int leader = 0;
+  for (int l = 1; l < LANES; l++) {
+    if (lanes->remaining[l] > lanes->remaining[leader]) {
+      leader = l;
+    }
+  }
+  if (lanes->remaining[leader] == 0) {
+    return false;
+  }
+
+  uint16_t pc = lanes->pc[leader];
+  uint16_t opcode = laneOpcode(lanes, leader, pc);
+  bool mask[LANES];
+  for (int l = 0; l < LANES; l++) {
+    mask[l] = lanes->remaining[l] > 0 && lanes->pc[l] == pc &&
+              laneOpcode(lanes, l, pc) == opcode;
+    lanes->remaining[l] -= mask[l];
+    lanes->pc[l] += mask[l] ? 2 : 0;
+  }
+
+  Instruction in = decode(opcode, lanes->quirks);
+  uint8_t *VX = lanes->V[in.X];
+  uint8_t *VY = lanes->V[in.Y];
+  uint8_t *VF = lanes->V[0xF];
+
+  Handler execute = in.execute;
+  if (execute == x00E0 || execute == x00FE || execute == x00FF) {
+    for (int row = 0; row < DISPLAY_WORDS; row++) {
+      for (int l = 0; l < LANES; l++) {
+        lanes->display[row][l] = mask[l] ? 0 : lanes->display[row][l];
+      }
+    }
+    for (int l = 0; l < LANES && execute != x00E0; l++) {
+      lanes->hires[l] = mask[l] ? execute == x00FF : lanes->hires[l];
+    }
+  } else if (execute == x00CN || execute == x00FB || execute == x00FC) {
+    for (int l = 0; l < LANES; l++) {
+      uint64_t *display = &lanes->display[0][l];
+      bool hires = lanes->hires[l];
+      if (!mask[l]) {
+        continue;
+      }
+      // Scrolling is rare enough that it isn't worth specialising here
+      if (execute == x00CN) {
+        scrollDown(display, LANES, in.N, hires);
+      } else if (execute == x00FB) {
+        scrollRight(display, LANES, hires);
+      } else {
+        scrollLeft(display, LANES, hires);
+      }
+    }
+  } else if (execute == x00EE) {
+    for (int l = 0; l < LANES; l++) {
+      if (mask[l] && lanes->sp[l] > 0) {
+        lanes->pc[l] = lanes->stack[--lanes->sp[l]][l];
+      }
+    }
+  } else if (execute == x1NNN) {
+    for (int l = 0; l < LANES; l++) {
+      lanes->pc[l] = mask[l] ? in.NNN : lanes->pc[l];
+    }
+  } else if (execute == x2NNN) {
+    for (int l = 0; l < LANES; l++) {
+      if (mask[l]) {
+        if (lanes->sp[l] > STACK_SIZE - 1) {
+          trapLane(lanes, l, TRAP_STACK_OVERFLOW, opcode);
+          continue;
+        }
+        lanes->stack[lanes->sp[l]++][l] = lanes->pc[l];
+        lanes->pc[l] = in.NNN;
+      }
+    }
+  } else if (execute == x3XNN) {
+    for (int l = 0; l < LANES; l++) {
+      lanes->pc[l] += (mask[l] && VX[l] == in.NN) ? 2 : 0;
+    }
+  } else if (execute == x4XNN) {
+    for (int l = 0; l < LANES; l++) {
+      lanes->pc[l] += (mask[l] && VX[l] != in.NN) ? 2 : 0;
+    }
+  } else if (execute == x5XY0 || execute == x9XY0) {
+    bool equal = execute == x5XY0;
+    for (int l = 0; l < LANES; l++) {
+      lanes->pc[l] += (mask[l] && (VX[l] == VY[l]) == equal) ? 2 : 0;
+    }
+  } else if (execute == x6XNN) {
+    for (int l = 0; l < LANES; l++) {
+      VX[l] = mask[l] ? in.NN : VX[l];
+    }
+  } else if (execute == x7XNN) {
+    for (int l = 0; l < LANES; l++) {
+      VX[l] = mask[l] ? VX[l] + in.NN : VX[l];
+    }
+  } else if (execute == x8XY0) {
+    for (int l = 0; l < LANES; l++) {
+      VX[l] = mask[l] ? VY[l] : VX[l];
+    }
+  } else if (execute == x8XY1 || execute == x8XY1Reset) {
+    bool reset = execute == x8XY1Reset;
+    for (int l = 0; l < LANES; l++) {
+      VX[l] = mask[l] ? VX[l] | VY[l] : VX[l];
+      VF[l] = mask[l] && reset ? 0 : VF[l];
+    }
+  } else if (execute == x8XY2 || execute == x8XY2Reset) {
+    bool reset = execute == x8XY2Reset;
+    for (int l = 0; l < LANES; l++) {
+      VX[l] = mask[l] ? VX[l] & VY[l] : VX[l];
+      VF[l] = mask[l] && reset ? 0 : VF[l];
+    }
+  } else if (execute == x8XY3 || execute == x8XY3Reset) {
+    bool reset = execute == x8XY3Reset;
+    for (int l = 0; l < LANES; l++) {
+      VX[l] = mask[l] ? VX[l] ^ VY[l] : VX[l];
+      VF[l] = mask[l] && reset ? 0 : VF[l];
+    }
+  } else if (execute == x8XY4) {
+    // Both operands are read before VX is written and VF last, the same
+    // as x8XY4
+    for (int l = 0; l < LANES; l++) {
+      uint8_t x = VX[l], y = VY[l];
+      VX[l] = mask[l] ? x + y : x;
+      VF[l] = mask[l] ? (x + y) > 0xFF : VF[l];
+    }
+  } else if (execute == x8XY5) {
+    for (int l = 0; l < LANES; l++) {
+      uint8_t x = VX[l], y = VY[l];
+      VX[l] = mask[l] ? x - y : x;
+      VF[l] = mask[l] ? (y > x ? 0x0 : 0x1) : VF[l];
+    }
+  } else if (execute == x8XY6 || execute == x8XY6Quirk) {
+    uint8_t *V = execute == x8XY6Quirk ? VY : VX;
+    for (int l = 0; l < LANES; l++) {
+      uint8_t value = V[l];
+      VX[l] = mask[l] ? value >> 1 : VX[l];
+      VF[l] = mask[l] ? (value & 1) : VF[l];
+    }
+  } else if (execute == x8XY7) {
+    for (int l = 0; l < LANES; l++) {
+      uint8_t x = VX[l], y = VY[l];
+      VX[l] = mask[l] ? y - x : x;
+      VF[l] = mask[l] ? (x > y ? 0x0 : 0x1) : VF[l];
+    }
+  } else if (execute == x8XYE || execute == x8XYEQuirk) {
+    uint8_t *V = execute == x8XYEQuirk ? VY : VX;
+    for (int l = 0; l < LANES; l++) {
+      uint8_t value = V[l];
+      VX[l] = mask[l] ? value << 1 : VX[l];
+      VF[l] = mask[l] ? value >> 7 : VF[l];
+    }
+  } else if (execute == xANNN) {
+    for (int l = 0; l < LANES; l++) {
+      lanes->index[l] = mask[l] ? in.NNN : lanes->index[l];
+    }
+  } else if (execute == xBNNN || execute == xBXNN) {
+    uint8_t *V = execute == xBXNN ? VX : lanes->V[0x0];
+    for (int l = 0; l < LANES; l++) {
+      lanes->pc[l] = mask[l] ? in.NNN + V[l] : lanes->pc[l];
+    }
+  } else if (execute == xCXNN) {
+    for (int l = 0; l < LANES; l++) {
+      uint32_t x = lanes->rng[l];
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      lanes->rng[l] = mask[l] ? x : lanes->rng[l];
+      VX[l] = mask[l] ? (x >> 24) & in.NN : VX[l];
+    }
+  } else if (execute == xDXYN || execute == xDXYNWait || execute == xDXY0 ||
+             execute == xDXY0Hires) {
+    bool wait = execute == xDXYNWait;
+    for (int l = 0; l < LANES; l++) {
+      if (!mask[l]) {
+        continue;
+      }
+      bool big = execute == xDXY0 || (execute == xDXY0Hires && lanes->hires[l]);
+      int width = big ? 16 : 8;
+      int height = big ? 16 : in.N;
+      lanes->remaining[l] = wait ? 0 : lanes->remaining[l];
+      uint64_t *display = &lanes->display[0][l];
+      const uint8_t *memory = lanes->memory[l];
+      uint16_t index = lanes->index[l];
+
+      if (lanes->hires[l]) {
+        VF[l] = width == 16 ? drawSprite(display, LANES, NULL, memory, index,
+                                         VX[l], VY[l], 16, 16, true)
+                            : drawSprite(display, LANES, NULL, memory, index,
+                                         VX[l], VY[l], 8, height, true);
+      } else {
+        VF[l] = width == 16 ? drawSprite(display, LANES, NULL, memory, index,
+                                         VX[l], VY[l], 16, 16, false)
+                            : drawSprite(display, LANES, NULL, memory, index,
+                                         VX[l], VY[l], 8, height, false);
+      }
+    }
+  } else if (execute == xEX9E || execute == xEXA1) {
+    bool pressed = execute == xEX9E;
+    for (int l = 0; l < LANES; l++) {
+      bool isKeyPressed = lanes->keypad[VX[l] & 0xF][l];
+      lanes->pc[l] += (mask[l] && isKeyPressed == pressed) ? 2 : 0;
+    }
+  } else if (execute == xFX07) {
+    for (int l = 0; l < LANES; l++) {
+      VX[l] = mask[l] ? lanes->delay[l] : VX[l];
+    }
+  } else if (execute == xFX0A) {
+    for (int l = 0; l < LANES; l++) {
+      if (!mask[l]) {
+        continue;
+      }
+      int key = 0;
+      while (key < 0x10 && !lanes->keypad[key][l]) {
+        key++;
+      }
+      if (key < 0x10) {
+        VX[l] = key;
+      } else {
+        lanes->pc[l] -= 2;
+      }
+    }
+  } else if (execute == xFX15) {
+    for (int l = 0; l < LANES; l++) {
+      lanes->delay[l] = mask[l] ? VX[l] : lanes->delay[l];
+    }
+  } else if (execute == xFX18) {
+    for (int l = 0; l < LANES; l++) {
+      lanes->sound[l] = mask[l] ? VX[l] : lanes->sound[l];
+    }
+  } else if (execute == xFX1E) {
+    for (int l = 0; l < LANES; l++) {
+      lanes->index[l] += mask[l] ? VX[l] : 0;
+      VF[l] = mask[l] ? lanes->index[l] >= 0x1000 : VF[l];
+    }
+  } else if (execute == xFX29) {
+    for (int l = 0; l < LANES; l++) {
+      lanes->index[l] = mask[l] ? VX[l] * 5 : lanes->index[l];
+    }
+  } else if (execute == xFX33) {
+    for (int l = 0; l < LANES; l++) {
+      if (mask[l]) {
+        uint8_t value = VX[l];
+        uint16_t index = lanes->index[l];
+        lanes->memory[l][(index + 0) & 0xFFF] = value / 100 % 10;
+        lanes->memory[l][(index + 1) & 0xFFF] = value / 10 % 10;
+        lanes->memory[l][(index + 2) & 0xFFF] = value % 10;
+      }
+    }
+  } else if (execute == xFX55 || execute == xFX55Index ||
+             execute == xFX55IndexX) {
+    int step = execute == xFX55Index    ? in.X + 1
+               : execute == xFX55IndexX ? in.X
+                                        : 0;
+    for (int l = 0; l < LANES; l++) {
+      for (int i = 0; mask[l] && i <= in.X; i++) {
+        lanes->memory[l][(lanes->index[l] + i) & 0xFFF] = lanes->V[i][l];
+      }
+      lanes->index[l] += mask[l] ? step : 0;
+    }
+  } else if (execute == xFX65 || execute == xFX65Index ||
+             execute == xFX65IndexX) {
+    int step = execute == xFX65Index    ? in.X + 1
+               : execute == xFX65IndexX ? in.X
+                                        : 0;
+    for (int l = 0; l < LANES; l++) {
+      for (int i = 0; mask[l] && i <= in.X; i++) {
+        lanes->V[i][l] = lanes->memory[l][(lanes->index[l] + i) & 0xFFF];
+      }
+      lanes->index[l] += mask[l] ? step : 0;
+    }
+  } else {
+    for (int l = 0; l < LANES; l++) {
+      if (mask[l]) {
+        trapLane(lanes, l, TRAP_UNRECOGNISED_OPCODE, opcode);
+      }
+    }
+  }
+  return true;
+}
+
+// Run every lane for the same number of cycles, lanes that have diverged
+// take turns until they have all used up the budget
+void runLanes(Chip8Lanes *lanes, long budget) {
+  for (int l = 0; l < LANES; l++) {
+    lanes->remaining[l] = lanes->trap[l] == TRAP_NONE ? budget : 0;
+  }
+  while (stepLanes(lanes)) {
+  }
+}
+
+// Timers stop along with a trapped lane, as they do for a single machine
+void updateLaneTimers(Chip8Lanes *lanes) {
+  for (int l = 0; l < LANES; l++) {
+    bool running = lanes->trap[l] == TRAP_NONE;
+    lanes->delay[l] -= running && lanes->delay[l] > 0;
+    lanes->sound[l] -= running && lanes->sound[l] > 0;
+  }
+}
+
+// Run a ROM headless on every lane and report the final state of each
+void runLanesHeadless(Chip8 *chip8) {
+  Chip8Lanes *lanes = malloc(sizeof(*lanes));
+  if (lanes == NULL) {
+    fprintf(stderr, "Could not allocate %d lanes\n", LANES);
+    exit(EXIT_FAILURE);
+  }
+  setupLanes(lanes, chip8);
+
+  long totalCycles =
+      cycleBudget > 0
+          ? cycleBudget
+          : (chip8->clockPhase + frameBudget * chip8->clockSpeed) / FRAME_RATE;
+  long frames = 0;
+
+  // Every lane shares the one clock, carried on from the machine
+  for (long remaining = totalCycles; remaining > 0;) {
+    long cycles = frameCycles(chip8);
+    if (remaining < cycles) {
+      runLanes(lanes, remaining);
+      break;
+    }
+    remaining -= cycles;
+
+    runLanes(lanes, cycles);
+    updateLaneTimers(lanes);
+    frames++;
+  }
+
+  printf("cycles: %ld frames: %ld\n", totalCycles, frames);
+  for (int l = 0; l < LANES; l++) {
+    char report[REPORT_SIZE];
+    copyLane(lanes, l, chip8);
+    formatState(chip8, report, sizeof(report));
+    printf("== lane %d\n%s", l, report);
+  }
+
+  free(lanes);
+}
+
+// Synthetic programs that each hammer one class of instruction in a loop
+typedef struct Benchmark {
+  const char *name;
+  uint8_t program[32];
+  size_t size;
+} Benchmark;
+
+const Benchmark benchmarks[] = {
+    // 8XYn arithmetic with a jump back to the start of the loop
+    {"alu",
+     {0x60, 0x01, 0x61, 0x02, 0x62, 0x03, 0x80, 0x14, 0x81, 0x25, 0x82,
+      0x16, 0x83, 0x0E, 0x82, 0x31, 0x83, 0x02, 0x80, 0x13, 0x70, 0x01,
+      0x12, 0x06},
+     24},
+    // Draw and erase a font sprite as it moves around the screen
+    {"sprite",
+     {0xA0, 0x00, 0x60, 0x00, 0x61, 0x00, 0xD0, 0x15, 0x70, 0x03, 0x71, 0x02,
+      0xD0, 0x15, 0x12, 0x06},
+     16},
+    // Call a subroutine that returns straight away
+    {"call",
+     {0x22, 0x04, 0x12, 0x00, 0x00, 0xEE},
+     6},
+    // Store and load every register to and from memory away from the code
+    {"memory",
+     {0xA3, 0x00, 0xFF, 0x55, 0xFF, 0x65, 0x12, 0x02},
+     8},
+};
+
+static double secondsSince(Uint64 start) {
+  return (SDL_GetPerformanceCounter() - start) /
+         (double)SDL_GetPerformanceFrequency();
+}
+
+static void reportBenchmark(const char *name, const char *backend,
+                            long instructions, double seconds) {
+  printf("{\"benchmark\": \"%s\", \"backend\": \"%s\", \"instructions\": %ld, "
+         "\"seconds\": %.6f, \"ns_per_instruction\": %.3f, \"mips\": %.2f}\n",
+         name, backend, instructions, seconds, seconds * 1e9 / instructions,
+         instructions / seconds / 1e6);
+}
+
+// Time every benchmark on each backend and print one JSON object per line.
+// Run "make bench" to measure with an optimised build
+void runBenchmarks(void) {
+  long cycles = cycleBudget > 0 ? cycleBudget : 50000000;
+  Chip8 *chip8 = malloc(sizeof(*chip8));
+  Chip8Lanes *lanes = malloc(sizeof(*lanes));
+  if (chip8 == NULL || lanes == NULL) {
+    fprintf(stderr, "Could not allocate benchmark machines\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+    const Benchmark *benchmark = &benchmarks[i];
+
+    for (int cache = 0; cache <= 1; cache++) {
+      setupCHIP(chip8, &settings);
+      memcpy(&chip8->memory[0x200], benchmark->program, benchmark->size);
+      chip8->blockCache = cache;
+
+      Uint64 start = SDL_GetPerformanceCounter();
+      runCycles(chip8, cycles);
+      reportBenchmark(benchmark->name, cache ? "block-cache" : "interpreter",
+                      cycles, secondsSince(start));
+    }
+
+    // Every lane runs the whole budget so there is LANES times the work
+    setupCHIP(chip8, &settings);
+    memcpy(&chip8->memory[0x200], benchmark->program, benchmark->size);
+    setupLanes(lanes, chip8);
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    runLanes(lanes, cycles / LANES);
+    reportBenchmark(benchmark->name, "lanes", cycles / LANES * LANES,
+                    secondsSince(start));
+  }
+
+  free(lanes);
+  free(chip8);
+}
+
+// The architectural state a conformance run is judged on
+typedef struct Conformance {
+  uint8_t V[16];
+  uint16_t index;
+  uint16_t pc;
+  uint8_t delay;
+  uint8_t sound;
+  uint64_t display; // hashDisplay of the final frame
+  uint64_t memory;  // hashBytes of all of memory, only compared across cores
+} Conformance;
+
+// Small programs that each pin down a few instructions, with the state the
+// spec says they finish in
+typedef struct ConformanceCase {
+  const char *name;
+  uint8_t program[48];
+  size_t size;
+  uint8_t quirks;
+  long frames;
+  Conformance expected;
+} ConformanceCase;
+
+// hashDisplay of a cleared low resolution display
+#define BLANK_DISPLAY 0xd80ac658736bb725
+
+const ConformanceCase conformanceCases[] = {
+    // 5XY0 and 9XY0 compare VX against VY, taking each skip once
+    {"skips",
+     {0x60, 0x01, 0x61, 0x01, 0x62, 0x02, 0x50, 0x10, 0x6A, 0xFF, 0x50, 0x20,
+      0x6B, 0x01, 0x90, 0x20, 0x6C, 0xFF, 0x90, 0x10, 0x6D, 0x01, 0x12, 0x16},
+     24,
+     0,
+     10,
+     {.V = {[0x0] = 1, [0x1] = 1, [0x2] = 2, [0xB] = 1, [0xD] = 1},
+      .pc = 0x216,
+      .display = BLANK_DISPLAY}},
+    // 8XYE and 8XY6 shift the bit that falls off into VF
+    {"shifts",
+     {0x60, 0x81, 0x80, 0x0E, 0x8A, 0xF0, 0x61, 0x40, 0x81, 0x1E, 0x8B, 0xF0,
+      0x62, 0x03, 0x82, 0x26, 0x8C, 0xF0, 0x12, 0x12},
+     20,
+     0,
+     10,
+     {.V = {[0x0] = 0x02, [0x1] = 0x80, [0x2] = 0x01, [0xA] = 1, [0xC] = 1,
+            [0xF] = 1},
+      .pc = 0x212,
+      .display = BLANK_DISPLAY}},
+    // FX33 stores the hundreds digit first, read back with FX65
+    {"bcd",
+     {0x60, 0x7B, 0xA3, 0x00, 0xF0, 0x33, 0xF2, 0x65, 0x12, 0x08},
+     10,
+     0,
+     10,
+     {.V = {[0x0] = 1, [0x1] = 2, [0x2] = 3},
+      .index = 0x300,
+      .pc = 0x208,
+      .display = BLANK_DISPLAY}},
+    // FX15 and FX18 set the delay and sound timers, which count down once a
+    // frame
+    {"timers",
+     {0x60, 0x14, 0xF0, 0x15, 0x61, 0x05, 0xF1, 0x18, 0x12, 0x08},
+     10,
+     0,
+     10,
+     {.V = {[0x0] = 20, [0x1] = 5},
+      .pc = 0x208,
+      .delay = 10,
+      .display = BLANK_DISPLAY}},
+    // Carries, borrows, a call and return, and a BNNN jump
+    {"arithmetic",
+     {0x22, 0x2C, 0x60, 0xFF, 0x70, 0x02, 0x61, 0xFF, 0x62, 0x02, 0x81, 0x24,
+      0x8A, 0xF0, 0x63, 0x05, 0x64, 0x07, 0x83, 0x45, 0x8B, 0xF0, 0x85, 0x37,
+      0x8C, 0xF0, 0x60, 0x02, 0xB2, 0x1E, 0x6E, 0xFF, 0x6E, 0x01, 0x12, 0x22,
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x6D, 0x01, 0x00, 0xEE},
+     48,
+     0,
+     10,
+     {.V = {[0x0] = 0x02, [0x1] = 0x01, [0x2] = 0x02, [0x3] = 0xFE,
+            [0x4] = 0x07, [0x5] = 0xFE, [0xA] = 1, [0xC] = 1, [0xD] = 1,
+            [0xE] = 1, [0xF] = 1},
+      .pc = 0x222,
+      .display = BLANK_DISPLAY}},
+    // A jump to the last address, which runs an instruction that wraps
+    // around to address 0 and traps on it
+    {"wrap",
+     {0x1F, 0xFF},
+     2,
+     0,
+     10,
+     {.pc = 0xFFF, .display = BLANK_DISPLAY}},
+    // Without the SUPER-CHIP quirk DXY0 draws no rows at low resolution...
+    {"sprite16-lores",
+     {0xA0, 0x00, 0xD0, 0x00, 0x12, 0x04},
+     6,
+     0,
+     10,
+     {.pc = 0x204, .display = BLANK_DISPLAY}},
+    // ...and a 16x16 sprite at high resolution
+    {"sprite16-hires",
+     {0xA0, 0x00, 0x00, 0xFF, 0xD0, 0x00, 0x12, 0x06},
+     8,
+     0,
+     10,
+     {.pc = 0x206, .display = 0x6be852a99b9fadf5}},
+    // Drawing a font sprite twice erases it and reports the collision
+    {"sprites",
+     {0x60, 0x0A, 0xF0, 0x29, 0x61, 0x05, 0x62, 0x03, 0xD1, 0x25, 0xD1, 0x25,
+      0x8A, 0xF0, 0xD1, 0x25, 0x8B, 0xF0, 0x12, 0x12},
+     20,
+     0,
+     10,
+     {.V = {[0x0] = 0x0A, [0x1] = 5, [0x2] = 3, [0xA] = 1},
+      .index = 0x32,
+      .pc = 0x212,
+      .display = 0x6526d5746bffcf61}},
+    // The original machine's shifts read VY, FX55 moves the index on and the
+    // logic instructions clear VF
+    {"quirks",
+     {0x61, 0x03, 0x80, 0x16, 0x8A, 0xF0, 0x62, 0xC0, 0x83, 0x2E, 0x8B, 0xF0,
+      0xA3, 0x00, 0xF1, 0x55, 0x8C, 0x11, 0x12, 0x12},
+     20,
+     QUIRK_SHIFT_VY | QUIRK_INDEX | QUIRK_VF_RESET,
+     10,
+     {.V = {[0x0] = 1, [0x1] = 3, [0x2] = 0xC0, [0x3] = 0x80, [0xA] = 1,
+            [0xB] = 1, [0xC] = 3},
+      .index = 0x302,
+      .pc = 0x212,
+      .display = BLANK_DISPLAY}},
+    // With VF as the destination of an arithmetic or shift VF is left
+    // holding the flag, worked out from the values before the instruction
+    {"vf-destination",
+     {0x6F, 0x05, 0x8F, 0x06, 0x8A, 0xF0, 0x6F, 0xC0, 0x8F, 0x0E, 0x8B, 0xF0,
+      0x6F, 0xF0, 0x61, 0x20, 0x8F, 0x14, 0x8C, 0xF0, 0x6F, 0x05, 0x61, 0x03,
+      0x8F, 0x15, 0x8D, 0xF0, 0x6F, 0x03, 0x61, 0x05, 0x8F, 0x17, 0x8E, 0xF0,
+      0x6F, 0x07, 0x8F, 0x17, 0x12, 0x28},
+     42,
+     0,
+     10,
+     {.V = {[0x1] = 0x05, [0xA] = 1, [0xB] = 1, [0xC] = 1, [0xD] = 1,
+            [0xE] = 1},
+      .pc = 0x228,
+      .display = BLANK_DISPLAY}},
+    // The same when the shifts read VY and it is VF
+    {"vf-shift-vy",
+     {0x6F, 0x05, 0x8F, 0xF6, 0x8A, 0xF0, 0x6F, 0x06, 0x81, 0xF6, 0x6F, 0xC1,
+      0x82, 0xFE, 0x12, 0x0E},
+     16,
+     QUIRK_SHIFT_VY,
+     10,
+     {.V = {[0x1] = 0x03, [0x2] = 0x82, [0xA] = 1, [0xF] = 1},
+      .pc = 0x20E,
+      .display = BLANK_DISPLAY}},
+    // EX9E and EXA1 only look at the low nibble of VX, so with no keys held
+    // neither skips differently as VX steps from 0x10 round to 0
+    {"keys-out-of-range",
+     {0x64, 0x10, 0x65, 0x00, 0xE4, 0x9E, 0x75, 0x01, 0xE4, 0xA1, 0x75, 0x80,
+      0x74, 0x10, 0x34, 0x00, 0x12, 0x04, 0x12, 0x12},
+     20,
+     0,
+     30,
+     {.V = {[0x5] = 0x0F}, .pc = 0x212, .display = BLANK_DISPLAY}},
+};
+
+#define CONFORMANCE_CASE_COUNT                                                \
+  (sizeof(conformanceCases) / sizeof(conformanceCases[0]))
+
+// Seeded programs of random instructions are checked across the cores the
+// same way as ROMs given on the command line
+#define RANDOM_PROGRAM_COUNT 256
+#define RANDOM_PROGRAM_SIZE 128
+#define RANDOM_PROGRAM_FRAMES 10
+
+typedef struct RandomProgram {
+  char name[16];
+  uint8_t program[RANDOM_PROGRAM_SIZE];
+} RandomProgram;
+
+// Fill a program with random instructions the machine has. Jumps and calls
+// land inside the program and nothing waits for a key, so most of them keep
+// running until the check ends
+static void randomProgram(Chip8 *generator, uint8_t *program) {
+  static const uint8_t arithmetic[] = {0x0, 0x1, 0x2, 0x3, 0x4,
+                                       0x5, 0x6, 0x7, 0xE};
+  static const uint8_t misc[] = {0x07, 0x15, 0x18, 0x1E, 0x29,
+                                 0x33, 0x55, 0x65};
+
+  for (int i = 0; i < RANDOM_PROGRAM_SIZE; i += 2) {
+    uint16_t opcode = nextRandom(generator) << 8 | nextRandom(generator);
+    uint16_t target = 0x200 + (opcode % RANDOM_PROGRAM_SIZE & ~1);
+
+    switch (opcode >> 12) {
+    case 0x0:
+      opcode = opcode & 1 ? 0x00EE : 0x00E0;
+      break;
+    case 0x1:
+    case 0x2:
+    case 0xB:
+      opcode = (opcode & 0xF000) | target;
+      break;
+    case 0x8:
+      opcode = (opcode & 0xFFF0) | arithmetic[opcode % sizeof(arithmetic)];
+      break;
+    case 0xE:
+      opcode = (opcode & 0xFF00) | (opcode & 1 ? 0x9E : 0xA1);
+      break;
+    case 0xF:
+      opcode = (opcode & 0xFF00) | misc[opcode % sizeof(misc)];
+      break;
+    }
+    program[i] = opcode >> 8;
+    program[i + 1] = opcode & 0xFF;
+  }
+}
+
+// Every way this build can run a machine. The interpreter is the reference
+// the others are checked against
+typedef enum Core {
+  CORE_INTERPRETER,
+  CORE_BLOCK_CACHE,
+  CORE_LANES,
+#ifdef CHIP8_AOT
+  CORE_COMPILED,
+#endif
+  CORE_COUNT
+} Core;
+
+const char *const coreNames[] = {"interpreter", "block-cache", "lanes",
+#ifdef CHIP8_AOT
+                                 "compiled",
+#endif
+};
+
+static void captureConformance(const Chip8 *chip8, Conformance *state) {
+  memcpy(state->V, chip8->V, sizeof(state->V));
+  state->index = chip8->index;
+  state->pc = chip8->pc;
+  state->delay = chip8->delay;
+  state->sound = chip8->sound;
+  state->display = hashDisplay(chip8);
+  state->memory = hashBytes(chip8->memory, sizeof(chip8->memory));
+}
+
+// The first part of the state that differs, or NULL if it all matches
+static const char *conformanceDifference(const Conformance *expected,
+                                         const Conformance *actual,
+                                         bool memory, char name[4]) {
+  for (int i = 0; i < 16; i++) {
+    if (expected->V[i] != actual->V[i]) {
+      snprintf(name, 4, "V%X", i);
+      return name;
+    }
+  }
+  if (expected->index != actual->index) {
+    return "index";
+  }
+  if (expected->pc != actual->pc) {
+    return "pc";
+  }
+  if (expected->delay != actual->delay) {
+    return "delay";
+  }
+  if (expected->sound != actual->sound) {
+    return "sound";
+  }
+  if (expected->display != actual->display) {
+    return "display";
+  }
+  if (memory && expected->memory != actual->memory) {
+    return "memory";
+  }
+  return NULL;
+}
+
+// Run a machine for some frames on one core, leaving the final state of
+// each machine it ran in states. Returns how many that was, which is one
+// for every lane on the lanes core
+static int runOnCore(const Chip8 *start, Core core, long frames,
+                     Chip8 *chip8, Chip8Lanes *lanes, Conformance *states) {
+  *chip8 = *start;
+#ifdef CHIP8_AOT
+  chip8->compiled = core == CORE_COMPILED && start->compiled;
+#endif
+
+  if (core == CORE_LANES) {
+    // The machine only keeps the clock, every lane shares it
+    setupLanes(lanes, chip8);
+    for (long frame = 0; frame < frames; frame++) {
+      runLanes(lanes, frameCycles(chip8));
+      updateLaneTimers(lanes);
+    }
+    for (int l = 0; l < LANES; l++) {
+      copyLane(lanes, l, chip8);
+      captureConformance(chip8, &states[l]);
+    }
+    return LANES;
+  }
+
+  chip8->blockCache = core == CORE_BLOCK_CACHE;
+  for (long frame = 0; frame < frames; frame++) {
+    if (runFrame(chip8, NULL, 0) == STOP_TRAP) {
+      break;
+    }
+  }
+  captureConformance(chip8, &states[0]);
+  return 1;
+}
+
+// Check one machine on every core against the expected state, or against
+// the interpreter when there is none, writing a line per core to report.
+// Returns the number of failures
+static int checkConformance(const Chip8 *start, long frames,
+                            const Conformance *expected, Chip8 *chip8,
+                            Chip8Lanes *lanes, char *report,
+                            size_t reportSize) {
+  Conformance reference;
+  Conformance states[LANES];
+  char name[4];
+  int failures = 0;
+  size_t used = 0;
+
+  for (Core core = 0; core < CORE_COUNT; core++) {
+    int count = runOnCore(start, core, frames, chip8, lanes, states);
+    if (core == CORE_INTERPRETER && expected == NULL) {
+      reference = states[0];
+      continue;
+    }
+
+    // Lanes only match each other when nothing draws on the per-lane
+    // random numbers, which golden programs never do
+    const Conformance *want = expected ? expected : &reference;
+    const char *difference = NULL;
+    int lane = 0;
+    for (; lane < (expected ? count : 1) && difference == NULL; lane++) {
+      difference = conformanceDifference(want, &states[lane], !expected, name);
+    }
+
+    int written;
+    if (difference == NULL) {
+      written = snprintf(report + used, reportSize - used, "%s ok\n",
+                         coreNames[core]);
+    } else if (core == CORE_LANES) {
+      written = snprintf(report + used, reportSize - used,
+                         "%s lane %d: %s differs\n", coreNames[core],
+                         lane - 1, difference);
+      failures++;
+    } else {
+      written = snprintf(report + used, reportSize - used, "%s: %s differs\n",
+                         coreNames[core], difference);
+      failures++;
+    }
+    if (written > 0) {
+      used += (size_t)written < reportSize - used ? (size_t)written
+                                                  : reportSize - used - 1;
+    }
+  }
+  return failures;
+}
+
+typedef struct Job {
+  const char *name;
+  char *filePath;     // Read from here if there is no image
+  const uint8_t *rom; // ROM image already in memory
+  size_t romSize;
+  int quirkProfile; // Overrides --quirks unless 0
+  bool conformance; // Check it on every core instead of running it
+  const ConformanceCase *test; // Golden program it is checked against
+  long frames;                 // How long it is checked for
+  int failures; // Counted by conformance checks and ROMs that won't load
+  char report[REPORT_SIZE];
+} Job;
+
+typedef struct Batch {
+  Job *jobs;
+  int count;
+  const uint8_t *state; // Snapshot every job starts from, if there is one
+  size_t stateLength;
+  SDL_atomic_t next; // Index of the next job to be claimed
+} Batch;
+
+// Workers claim one job at a time, so a long running ROM only holds up the
+// worker running it while the others carry on with the rest of the batch
+static int batchWorker(void *data) {
+  Batch *batch = data;
+  Chip8 *chip8 = malloc(sizeof(*chip8));
+  if (chip8 == NULL) {
+    fprintf(stderr, "Could not allocate a machine for a batch worker\n");
+    exit(EXIT_FAILURE);
+  }
+  BaseImage base;
+  // Only conformance jobs need somewhere to run the machine on each core
+  Chip8 *scratch = NULL;
+  Chip8Lanes *lanes = NULL;
+
+  int i;
+  while ((i = SDL_AtomicAdd(&batch->next, 1)) < batch->count) {
+    Job *job = &batch->jobs[i];
+
+    setupCHIP(chip8, &settings);
+    if (job->quirkProfile) {
+      chip8->quirks = quirkProfiles[job->quirkProfile].quirks;
+    }
+    // A ROM that can't be loaded only fails its own job
+    const char *error;
+    if (job->rom) {
+      error = loadROMBuffer(chip8, job->rom, job->romSize)
+                  ? NULL
+                  : "is larger than the available memory";
+    } else {
+      error = loadROM(job->filePath, chip8);
+    }
+    if (error) {
+      snprintf(job->report, sizeof(job->report), "ROM %s\n", error);
+      job->failures = 1;
+      continue;
+    }
+
+    if (job->conformance) {
+      if (lanes == NULL) {
+        scratch = malloc(sizeof(*scratch));
+        lanes = malloc(sizeof(*lanes));
+        if (scratch == NULL || lanes == NULL) {
+          fprintf(stderr, "Could not allocate conformance machines\n");
+          exit(EXIT_FAILURE);
+        }
+      }
+      if (job->test) {
+        chip8->quirks = job->test->quirks;
+      }
+      job->failures = checkConformance(
+          chip8, job->frames, job->test ? &job->test->expected : NULL,
+          scratch, lanes, job->report, sizeof(job->report));
+      continue;
+    }
+
+    captureBase(&base, chip8);
+    if (batch->state &&
+        !loadState(chip8, &base, batch->state, batch->stateLength)) {
+      snprintf(job->report, sizeof(job->report),
+               "state does not match this ROM\n");
+      continue;
+    }
+
+    runHeadless(chip8, NULL, job->report, sizeof(job->report));
+  }
+
+  free(lanes);
+  free(scratch);
+  free(chip8);
+  return 0;
+}
+
+// Run every job across a pool of worker threads and print the reports in
+// the order the jobs were given
+void runJobs(Job *jobs, int count) {
+  Batch batch = {.jobs = jobs, .count = count};
+  SDL_AtomicSet(&batch.next, 0);
+
+  // Every job forks from the same snapshot rather than booting from scratch
+  uint8_t state[MAX_SNAPSHOT_SIZE];
+  if (loadStatePath) {
+    batch.stateLength = readStateFile(loadStatePath, state);
+    batch.state = state;
+  }
+
+  int workerCount = jobCount > 0 ? jobCount : SDL_GetCPUCount();
+  if (workerCount > count) {
+    workerCount = count;
+  }
+
+  SDL_Thread **workers = calloc(workerCount, sizeof(SDL_Thread *));
+  for (int i = 0; i < workerCount; i++) {
+    workers[i] = SDL_CreateThread(batchWorker, "chip8-worker", &batch);
+    if (workers[i] == NULL) {
+      fprintf(stderr, "Error : %s\n", SDL_GetError());
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (int i = 0; i < workerCount; i++) {
+    SDL_WaitThread(workers[i], NULL);
+  }
+
+  for (int i = 0; i < count; i++) {
+    printf("== %s\n%s", jobs[i].name, jobs[i].report);
+  }
+
+  free(workers);
+}
+
+static Job *allocateJobs(int count) {
+  Job *jobs = calloc(count > 0 ? count : 1, sizeof(Job));
+  if (jobs == NULL) {
+    fprintf(stderr, "Could not allocate %d batch jobs\n", count);
+    exit(EXIT_FAILURE);
+  }
+  return jobs;
+}
+
+void runBatch(char *const *filePaths, int count) {
+  Job *jobs = allocateJobs(count);
+  for (int i = 0; i < count; i++) {
+    jobs[i].name = jobs[i].filePath = filePaths[i];
+  }
+  runJobs(jobs, count);
+  free(jobs);
+}
+
+// Run the built in programs against their expected state on every core, then
+// the seeded random programs and any ROMs given against the interpreter,
+// spread over the batch workers. Exits with a failure if anything differs
+void runConformance(char *const *filePaths, int fileCount) {
+  int cases = CONFORMANCE_CASE_COUNT;
+  int count = cases + RANDOM_PROGRAM_COUNT + fileCount;
+  Job *jobs = allocateJobs(count);
+  RandomProgram *programs = calloc(RANDOM_PROGRAM_COUNT, sizeof(*programs));
+  Chip8 *generator = malloc(sizeof(*generator));
+
+  if (programs == NULL || generator == NULL) {
+    fprintf(stderr, "Could not allocate random programs\n");
+    exit(EXIT_FAILURE);
+  }
+  // The programs come from --seed, and take turns with each quirk profile
+  setupCHIP(generator, &settings);
+  for (int i = 0; i < RANDOM_PROGRAM_COUNT; i++) {
+    Job *job = &jobs[cases + i];
+
+    snprintf(programs[i].name, sizeof(programs[i].name), "random-%d", i);
+    randomProgram(generator, programs[i].program);
+    job->name = programs[i].name;
+    job->rom = programs[i].program;
+    job->romSize = RANDOM_PROGRAM_SIZE;
+    job->quirkProfile = i % QUIRK_PROFILE_COUNT;
+    job->frames = RANDOM_PROGRAM_FRAMES;
+  }
+
+  for (int i = 0; i < cases; i++) {
+    jobs[i].test = &conformanceCases[i];
+    jobs[i].name = jobs[i].test->name;
+    jobs[i].rom = jobs[i].test->program;
+    jobs[i].romSize = jobs[i].test->size;
+    jobs[i].frames = jobs[i].test->frames;
+  }
+  for (int i = 0; i < fileCount; i++) {
+    Job *job = &jobs[cases + RANDOM_PROGRAM_COUNT + i];
+    job->name = job->filePath = filePaths[i];
+    job->frames = frameBudget;
+  }
+  for (int i = 0; i < count; i++) {
+    jobs[i].conformance = true;
+  }
+  runJobs(jobs, count);
+
+  int failures = 0;
+  for (int i = 0; i < count; i++) {
+    failures += jobs[i].failures;
+  }
+  free(generator);
+  free(programs);
+  free(jobs);
+  if (failures > 0) {
+    printf("%d failures\n", failures);
+    exit(EXIT_FAILURE);
+  }
+}
+
+// A pack is one file holding a whole corpus of ROMs, so a batch can map it
+// once and copy each ROM straight into a machine. It starts with the magic
+// "CH8P", a version byte, three reserved bytes and the number of ROMs. Then
+// comes an index with one PACK_ENTRY_SIZE entry per ROM giving the offset
+// of its image in the file, its size, its quirk profile, a reserved byte,
+// the hash of its image and its name padded out with zeros. The images
+// follow the index. All numbers are little endian
+typedef struct Pack {
+  uint8_t *data;
+  size_t size;
+  int count;
+} Pack;
+
+typedef struct PackEntry {
+  const uint8_t *rom;
+  size_t size;
+  uint8_t quirks;
+  uint64_t hash;
+  char name[PACK_NAME_SIZE + 1];
+} PackEntry;
+
+static const uint8_t *packIndex(const Pack *pack, int i) {
+  return &pack->data[PACK_HEADER_SIZE + (size_t)i * PACK_ENTRY_SIZE];
+}
+
+void getPackEntry(const Pack *pack, int i, PackEntry *entry) {
+  const uint8_t *in = packIndex(pack, i);
+  size_t offset = getValue(&in, 4);
+
+  entry->size = getValue(&in, 2);
+  entry->quirks = getValue(&in, 1);
+  in++;
+  entry->hash = getValue(&in, 8);
+  memcpy(entry->name, in, PACK_NAME_SIZE);
+  entry->name[PACK_NAME_SIZE] = '\0';
+  entry->rom = &pack->data[offset];
+}
+
+// Map a pack into memory and check every entry lies inside it and matches
+// its hash, so the ROMs can be used without any further checks
+void openPack(Pack *pack, const char *filePath) {
+  FILE *packFile = fopen(filePath, "rb");
+  if (packFile == NULL) {
+    fprintf(stderr, "Could not open %s\n", filePath);
+    exit(EXIT_FAILURE);
+  }
+  fseek(packFile, 0, SEEK_END);
+  long size = ftell(packFile);
+
+  pack->data = size >= PACK_HEADER_SIZE
+                   ? mmap(NULL, size, PROT_READ, MAP_PRIVATE,
+                          fileno(packFile), 0)
+                   : MAP_FAILED;
+  fclose(packFile);
+  if (pack->data == MAP_FAILED || memcmp(pack->data, "CH8P", 4) != 0 ||
+      pack->data[4] != PACK_VERSION) {
+    fprintf(stderr, "%s is not a ROM pack\n", filePath);
+    exit(EXIT_FAILURE);
+  }
+  pack->size = size;
+
+  const uint8_t *in = &pack->data[8];
+  uint64_t count = getValue(&in, 4);
+  if (count > (pack->size - PACK_HEADER_SIZE) / PACK_ENTRY_SIZE) {
+    fprintf(stderr, "%s has a truncated index\n", filePath);
+    exit(EXIT_FAILURE);
+  }
+  pack->count = count;
+
+  for (int i = 0; i < pack->count; i++) {
+    const uint8_t *index = packIndex(pack, i);
+    uint64_t offset = getValue(&index, 4);
+    uint64_t romSize = getValue(&index, 2);
+    PackEntry entry;
+
+    uint64_t profile = getValue(&index, 1);
+    if (romSize > MAX_ROM_SIZE || offset > pack->size ||
+        romSize > pack->size - offset || profile >= QUIRK_PROFILE_COUNT) {
+      fprintf(stderr, "%s has a damaged entry for ROM %d\n", filePath, i);
+      exit(EXIT_FAILURE);
+    }
+    getPackEntry(pack, i, &entry);
+    if (hashBytes(entry.rom, entry.size) != entry.hash) {
+      fprintf(stderr, "%s: %s does not match its hash\n", filePath,
+              entry.name);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+void closePack(Pack *pack) {
+  munmap(pack->data, pack->size);
+  pack->data = NULL;
+}
+
+// Bundle ROM files into a pack named after their file names, all marked
+// with the --quirks profile
+void writePack(const char *outPath, char *const *filePaths, int count) {
+  uint8_t *images = malloc((size_t)count * MAX_ROM_SIZE + 1);
+  uint8_t *index = calloc(count > 0 ? count : 1, PACK_ENTRY_SIZE);
+  if (images == NULL || index == NULL) {
+    fprintf(stderr, "Could not allocate a pack of %d ROMs\n", count);
+    exit(EXIT_FAILURE);
+  }
+
+  size_t offset = PACK_HEADER_SIZE + (size_t)count * PACK_ENTRY_SIZE;
+  size_t total = 0;
+  for (int i = 0; i < count; i++) {
+    const char *error;
+    long size = readROMFile(filePaths[i], &images[total], &error);
+    if (size < 0) {
+      fprintf(stderr, "%s %s\n", filePaths[i], error);
+      exit(EXIT_FAILURE);
+    }
+
+    const char *name = strrchr(filePaths[i], '/');
+    name = name ? name + 1 : filePaths[i];
+
+    uint8_t *out = &index[(size_t)i * PACK_ENTRY_SIZE];
+    out = putValue(out, offset + total, 4);
+    out = putValue(out, size, 2);
+    out = putValue(out, settings.quirkProfile, 1);
+    out = putValue(out, 0, 1);
+    out = putValue(out, hashBytes(&images[total], size), 8);
+    strncpy((char *)out, name, PACK_NAME_SIZE);
+    total += size;
+  }
+
+  uint8_t header[PACK_HEADER_SIZE] = {'C', 'H', '8', 'P', PACK_VERSION};
+  putValue(&header[8], count, 4);
+
+  FILE *packFile = fopen(outPath, "wb");
+  bool written = packFile != NULL;
+  written = written && fwrite(header, sizeof(header), 1, packFile) == 1;
+  written = written && fwrite(index, PACK_ENTRY_SIZE, count, packFile) ==
+                           (size_t)count;
+  written = written && fwrite(images, 1, total, packFile) == total;
+  if (packFile == NULL || fclose(packFile) != 0 || !written) {
+    fprintf(stderr, "Could not write %s\n", outPath);
+    exit(EXIT_FAILURE);
+  }
+
+  free(images);
+  free(index);
+}
+
+// Run every ROM in a pack as a batch without touching any other files
+void runCorpus(const char *filePath) {
+  Pack pack;
+  openPack(&pack, filePath);
+
+  Job *jobs = allocateJobs(pack.count);
+  PackEntry *entries = calloc(pack.count > 0 ? pack.count : 1,
+                              sizeof(PackEntry));
+  if (entries == NULL) {
+    fprintf(stderr, "Could not allocate %d batch jobs\n", pack.count);
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < pack.count; i++) {
+    getPackEntry(&pack, i, &entries[i]);
+    jobs[i].name = entries[i].name;
+    jobs[i].rom = entries[i].rom;
+    jobs[i].romSize = entries[i].size;
+    jobs[i].quirkProfile = entries[i].quirks;
+  }
+  runJobs(jobs, pack.count);
+
+  free(entries);
+  free(jobs);
+  closePack(&pack);
+}
+
+// Paces frames against absolute deadlines worked out from when pacing
+// started, so rounding errors never accumulate into drift
+typedef struct FrameScheduler {
+  bool sleep;       // Wait for deadlines rather than relying on vsync
+  bool report;      // Print pacing statistics once a second
+  Uint64 frequency; // Performance counter ticks per second
+  Uint64 origin;    // Counter value that frame deadlines are measured from
+  long frame;       // Number of the next frame due since origin
+  long skipped;     // Frames dropped because we fell too far behind
+  // Pacing measurements since the last report
+  Uint64 lastFrame;
+  Uint64 windowStart;
+  int windowFrames;
+  double jitterTotal;
+  double jitterMax;
+} FrameScheduler;
+
+void startScheduler(FrameScheduler *scheduler, bool sleep, bool report) {
+  Uint64 now = SDL_GetPerformanceCounter();
+
+  *scheduler = (FrameScheduler){
+      .sleep = sleep,
+      .report = report,
+      .frequency = SDL_GetPerformanceFrequency(),
+      .origin = now,
+      .windowStart = now,
+  };
+}
+
+static void recordFrame(FrameScheduler *scheduler, Uint64 now) {
+  double frequency = scheduler->frequency;
+
+  // There's no interval to measure until the second frame
+  if (scheduler->lastFrame != 0) {
+    double interval = (now - scheduler->lastFrame) / frequency;
+    double jitter = fabs(interval - 1.0 / FRAME_RATE) * 1000.0;
+
+    scheduler->jitterTotal += jitter;
+    if (jitter > scheduler->jitterMax) {
+      scheduler->jitterMax = jitter;
+    }
+  }
+  scheduler->lastFrame = now;
+  scheduler->windowFrames++;
+
+  double window = (now - scheduler->windowStart) / frequency;
+  if (window >= 1.0) {
+    if (scheduler->report) {
+      fprintf(stderr,
+              "fps: %.2f jitter: %.3f ms avg %.3f ms max skipped: %ld\n",
+              scheduler->windowFrames / window,
+              scheduler->jitterTotal / scheduler->windowFrames,
+              scheduler->jitterMax, scheduler->skipped);
+    }
+    scheduler->windowStart = now;
+    scheduler->windowFrames = 0;
+    scheduler->jitterTotal = 0;
+    scheduler->jitterMax = 0;
+  }
+}
+
+// Counter value a frame is due at, which can be before origin for the frame
+// before the first
+Uint64 frameDeadline(const FrameScheduler *scheduler, long frame) {
+  return scheduler->origin +
+         (int64_t)frame * (int64_t)scheduler->frequency / FRAME_RATE;
+}
+
+// Wait until the next frame is due and return how many frames should be
+// emulated to keep up with real time. Without sleeping this doesn't wait and
+// can return 0 if it is called more often than 60 times a second
+int waitForFrames(FrameScheduler *scheduler) {
+  Uint64 frequency = scheduler->frequency;
+  Uint64 deadline = frameDeadline(scheduler, scheduler->frame);
+  Uint64 now = SDL_GetPerformanceCounter();
+
+  if (scheduler->sleep) {
+    // Sleep while there's plenty of time left, as the OS can oversleep by a
+    // millisecond or so, then spin for the rest
+    while (now < deadline) {
+      Uint64 remainingMS = (deadline - now) * 1000 / frequency;
+      if (remainingMS > 2) {
+        SDL_Delay(remainingMS - 2);
+      }
+      now = SDL_GetPerformanceCounter();
     }
-    break;
-  default:
-    unrecognisedOpcode(chip8->opcode);
-    break;
   }
+
+  // Every frame whose deadline has passed is due
+  long due = (long)((now - scheduler->origin) * FRAME_RATE / frequency) + 1 -
+             scheduler->frame;
+  if (due <= 0) {
+    return 0;
+  }
+
+  if (due > MAX_CATCH_UP_FRAMES) {
+    // Too far behind to catch up, drop the backlog and pace from now on
+    scheduler->skipped += due - MAX_CATCH_UP_FRAMES;
+    due = MAX_CATCH_UP_FRAMES;
+    scheduler->origin = now;
+    scheduler->frame = 1;
+  } else {
+    scheduler->frame += due;
+  }
+
+  recordFrame(scheduler, now);
+  return due;
 }
 
-void xD(Chip8 *chip8) {
-  // DXYN - Draw a sprite N pixels tall from the index register at position
-  // VX, VY
-  uint8_t X = chip8->V[(chip8->opcode & 0x0F00) >> 8] % 64;
-  uint8_t Y = chip8->V[(chip8->opcode & 0x00F0) >> 4] % 32;
-  uint8_t N = chip8->opcode & 0x000F;
+// Triple buffered displays handed from the emulation thread to the render
+// thread without locking. Each side owns one buffer and they swap with the
+// spare one, so the emulation thread never waits for the renderer and the
+// renderer always has a complete frame to read
+typedef struct FrameExchange {
+  uint64_t buffers[3][DISPLAY_WORDS];
+  bool hires[3];       // Resolution each buffer was drawn at
+  int back;            // Buffer owned by the emulation thread
+  int front;           // Buffer owned by the render thread
+  SDL_atomic_t spare;  // Spare buffer, with FRESH_FRAME set if it is new
+} FrameExchange;
 
-  // Set VF to 0 to reset flag
-  chip8->V[0xF] = 0;
+void publishFrame(FrameExchange *exchange, const uint64_t *display,
+                  bool hires) {
+  memcpy(exchange->buffers[exchange->back], display,
+         sizeof(exchange->buffers[0]));
+  exchange->hires[exchange->back] = hires;
 
-  for (int row = 0; row < N; row++) {
-    uint8_t pixelByte = chip8->memory[chip8->index + row];
+  // SDL_AtomicSet is only an acquire barrier on some compilers, so fence the
+  // frame's writes before it and the render thread's reads of the buffer
+  // coming back after it
+  SDL_MemoryBarrierRelease();
+  exchange->back =
+      SDL_AtomicSet(&exchange->spare, exchange->back | FRESH_FRAME) & 3;
+  SDL_MemoryBarrierAcquire();
+}
 
-    // Break if we reach the bottom of the screen
-    if (Y + row > 31) {
-      break;
+// Returns NULL if there's nothing new, otherwise the latest display with
+// hires set to its resolution
+const uint64_t *consumeFrame(FrameExchange *exchange, bool *hires) {
+  // Only the emulation thread can change the spare buffer in between, and it
+  // can only replace it with another fresh frame
+  if (!(SDL_AtomicGet(&exchange->spare) & FRESH_FRAME)) {
+    return NULL;
+  }
+  SDL_MemoryBarrierRelease();
+  exchange->front = SDL_AtomicSet(&exchange->spare, exchange->front) & 3;
+  SDL_MemoryBarrierAcquire();
+  *hires = exchange->hires[exchange->front];
+  return exchange->buffers[exchange->front];
+}
+
+// Keypad changes handed from the render thread to the emulation thread, each
+// stamped with the performance counter time it happened at so it can be
+// placed at the matching cycle of the frame that covers it. Only the render
+// thread pushes and only the emulation thread pops, so the two indices are
+// enough to share it without locking
+typedef struct KeyEvent {
+  Uint64 time;
+  Uint32 keys; // Whole bitmask held after the change
+} KeyEvent;
+
+typedef struct KeyQueue {
+  KeyEvent events[KEY_QUEUE_SIZE];
+  SDL_atomic_t head; // Next event to pop, written by the emulation thread
+  SDL_atomic_t tail; // Next slot to push, written by the render thread
+} KeyQueue;
+
+// Returns false and drops the event if the emulation thread is too far
+// behind to have room for it
+bool pushKeyEvent(KeyQueue *queue, KeyEvent event) {
+  unsigned tail = SDL_AtomicGet(&queue->tail);
+  if (tail - (unsigned)SDL_AtomicGet(&queue->head) == KEY_QUEUE_SIZE) {
+    return false;
+  }
+  // Don't reuse the slot until the emulation thread has finished reading it
+  SDL_MemoryBarrierAcquire();
+  queue->events[tail % KEY_QUEUE_SIZE] = event;
+
+  // The event has to be visible before the index that publishes it
+  SDL_MemoryBarrierRelease();
+  SDL_AtomicSet(&queue->tail, tail + 1);
+  return true;
+}
+
+const KeyEvent *peekKeyEvent(KeyQueue *queue) {
+  unsigned head = SDL_AtomicGet(&queue->head);
+  if (head == (unsigned)SDL_AtomicGet(&queue->tail)) {
+    return NULL;
+  }
+  SDL_MemoryBarrierAcquire();
+  return &queue->events[head % KEY_QUEUE_SIZE];
+}
+
+void popKeyEvent(KeyQueue *queue) {
+  // Reads of the event happen before the render thread can overwrite it
+  SDL_MemoryBarrierRelease();
+  SDL_AtomicAdd(&queue->head, 1);
+}
+
+// Samples handed from the emulation thread to the audio callback. As with
+// the key queue each side only writes its own index, so neither ever waits on
+// the other, and the callback plays silence if it runs dry
+typedef struct Audio {
+  SDL_AudioDeviceID device; // 0 if there's no sound
+  int16_t samples[AUDIO_RING_SIZE];
+  SDL_atomic_t head; // Next sample to play, written by the callback
+  SDL_atomic_t tail; // Next sample to fill, written by the emulation thread
+  uint32_t phase;    // Position through the beeper's cycle out of 2^32
+} Audio;
+
+static void audioCallback(void *data, Uint8 *stream, int length) {
+  Audio *audio = data;
+  int16_t *out = (int16_t *)stream;
+  unsigned count = length / sizeof(int16_t);
+  unsigned head = SDL_AtomicGet(&audio->head);
+  unsigned available = (unsigned)SDL_AtomicGet(&audio->tail) - head;
+
+  // Samples are read after the tail that published them, and finished with
+  // before head hands their slots back
+  SDL_MemoryBarrierAcquire();
+  for (unsigned i = 0; i < count; i++) {
+    out[i] = i < available ? audio->samples[(head + i) % AUDIO_RING_SIZE] : 0;
+  }
+  SDL_MemoryBarrierRelease();
+  SDL_AtomicSet(&audio->head, head + (available < count ? available : count));
+}
+
+// Returns false and leaves the device closed if there's no way to play sound
+bool startAudio(Audio *audio) {
+  SDL_AudioSpec want = {.freq = SAMPLE_RATE,
+                        .format = AUDIO_S16SYS,
+                        .channels = 1,
+                        .samples = AUDIO_BUFFER_SAMPLES,
+                        .callback = audioCallback,
+                        .userdata = audio};
+
+  audio->phase = 0;
+  SDL_AtomicSet(&audio->head, 0);
+  SDL_AtomicSet(&audio->tail, 0);
+  audio->device = SDL_OpenAudioDevice(NULL, 0, &want, NULL, 0);
+  if (audio->device == 0) {
+    fprintf(stderr, "Could not open audio, continuing without sound: %s\n",
+            SDL_GetError());
+    return false;
+  }
+  SDL_PauseAudioDevice(audio->device, 0);
+  return true;
+}
+
+void stopAudio(Audio *audio) {
+  if (audio->device != 0) {
+    SDL_CloseAudioDevice(audio->device);
+    audio->device = 0;
+  }
+}
+
+// Generate a frame of the beeper, a square wave that sounds while the sound
+// timer runs. Anything that would queue more than a couple of frames ahead of
+// the callback is dropped so a stall can't leave the sound lagging the picture
+void pushBeep(Audio *audio, bool beeping) {
+  uint32_t step = (uint32_t)(((uint64_t)BEEP_FREQUENCY << 32) / SAMPLE_RATE);
+  unsigned tail = SDL_AtomicGet(&audio->tail);
+  unsigned queued = tail - (unsigned)SDL_AtomicGet(&audio->head);
+  unsigned count = queued < AUDIO_MAX_QUEUED ? AUDIO_MAX_QUEUED - queued : 0;
+
+  if (count > SAMPLES_PER_FRAME) {
+    count = SAMPLES_PER_FRAME;
+  }
+
+  // As with the key queue, slots are reused only after the callback is done
+  // with them and published only once they're written
+  SDL_MemoryBarrierAcquire();
+  for (unsigned i = 0; i < count; i++) {
+    int16_t sample = 0;
+    if (beeping) {
+      sample = audio->phase < 0x80000000u ? BEEP_VOLUME : -BEEP_VOLUME;
+      audio->phase += step;
+    } else {
+      // Start every beep at the same point so they all sound alike
+      audio->phase = 0;
     }
+    audio->samples[(tail + i) % AUDIO_RING_SIZE] = sample;
+  }
+  SDL_MemoryBarrierRelease();
+  SDL_AtomicSet(&audio->tail, tail + count);
+}
 
-    for (int col = 0; col < 8; col++) {
-      // Break if we reach the right edge of the screen
-      if (X + col > 63) {
-        break;
-      }
+typedef struct Emulator {
+  Chip8 *chip8;
+  Rewind *rewind;       // Recent frames if rewinding is enabled
+  Recording *recording; // Where to log keypad changes, if anywhere
+  Replay *replay;       // Recorded keys to play back instead of the keyboard
+  long frame;           // Frames emulated so far
+  FrameExchange frames;
+  KeyQueue input;       // Keypad changes from the render thread
+  Uint32 keys;          // Keys held as of the last change taken from input
+  Audio audio;          // The beeper, unless sound is off
+  SDL_atomic_t running; // Cleared by the render thread to stop emulation
+} Emulator;
 
-      // Read the bit corresponding to the current position in the
-      // sprite we're drawing
-      bool pixel = (pixelByte & (0x80 >> col)) >> (7 - col);
-      bool *displayPixel = &chip8->display[(X + col) + ((Y + row) * 64)];
-      // If bit is already being displayed then turn it on and set flag
-      if (pixel && *displayPixel) {
-        *displayPixel = false;
-        chip8->V[0xF] = 1;
-        // If bit is not being displayed, turn it on
-      } else if (pixel && !*displayPixel) {
-        *displayPixel = true;
-      }
+// Take the changes that happened before a frame's deadline, placing each at
+// the cycle of the frame that matches when it happened. The frame runs after
+// its deadline, so this is at most a frame late but keeps the spacing between
+// presses instead of rounding them all to the frame boundary
+static int takeKeyChanges(KeyQueue *input, Uint32 *keys,
+                          const FrameScheduler *scheduler, int clockSpeed,
+                          long frame, KeyChange *changes) {
+  Uint64 start = frameDeadline(scheduler, frame - 1);
+  Uint64 end = frameDeadline(scheduler, frame);
+  int count = 0;
+
+  const KeyEvent *event;
+  while (count < MAX_FRAME_CHANGES &&
+         (event = peekKeyEvent(input)) != NULL &&
+         event->time < end) {
+    long cycle = 0;
+    if (event->time > start) {
+      cycle = (long)((event->time - start) * clockSpeed / scheduler->frequency);
     }
+    changes[count++] = (KeyChange){cycle, event->keys};
+    *keys = event->keys;
+    popKeyEvent(input);
   }
+  return count;
 }
 
-void xF(Chip8 *chip8) {
-  uint8_t code = chip8->opcode & 0x00FF;
-  uint8_t X = (chip8->opcode & 0x0F00) >> 8;
-  uint8_t *VX = &chip8->V[X];
-  uint16_t initialIndex = chip8->index;
-  bool xFIndexQuirk = false;
+// Emulate a single 60Hz frame, or undo one while rewinding
+static void emulateFrame(Emulator *emulator, KeyChange *changes, int count) {
+  Chip8 *chip8 = emulator->chip8;
 
-  bool found = false;
-  switch (code) {
-  // FX07 - Set VX to the contents of the delay timer
-  case 0x07:
-    *VX = chip8->delay;
-    break;
-  // FX0A - Get pressed key and put it in VX
-  case 0x0A:
-    found = false;
-    for (int i = 0; i < 0x10; i++) {
-      if (chip8->keypad[i]) {
-        *VX = i;
-        found = true;
-        break;
-      }
+  // Holding the rewind key steps back through recent frames instead
+  if (emulator->rewind && (emulator->keys & REWIND_KEY)) {
+    rewindFrame(emulator->rewind, chip8);
+    setKeypad(chip8, emulator->keys);
+    return;
+  }
+
+  // A trapped machine stays stopped, and without rewind there is no way to
+  // get it going again
+  if (chip8->trap.code != TRAP_NONE) {
+    if (!emulator->rewind) {
+      SDL_AtomicSet(&emulator->running, 0);
     }
-    if (!found) {
-      chip8->pc -= 2;
+    return;
+  }
+
+  if (emulator->recording) {
+    for (int j = 0; j < count; j++) {
+      recordKeys(emulator->recording, emulator->frame, &changes[j]);
     }
-    break;
-  // FX15 - Set the sound timer to the value in VX
-  case 0x15:
-    chip8->delay = *VX;
-    break;
-  // FX18 - Set the sound timer to the value in VX
-  case 0x18:
-    chip8->sound = *VX;
-    break;
-  // FX1E - Add VX to index register
-  case 0x1E:
-    chip8->index += *VX;
-    // Set VF if index overflows addressable range
-    chip8->V[0xF] = chip8->index >= 0x1000;
-    break;
-  // FX29 - Point index to font in memory for VX
-  case 0x29:
-    chip8->index = (0 + (*VX * 5));
-    break;
-  // FX33 - Convert VX to a binary number and store each digit in memory
-  case 0x33:
-    convertHexToBinaryAndLoad(chip8);
-    break;
-  // FX55 - Store variables up to VX in successive memory locations
-  case 0x55:
-    for (int i = 0; i <= X; i++) {
-      chip8->memory[initialIndex + i] = chip8->V[i];
-      if (xFIndexQuirk) {
-        chip8->index++;
+  }
+  if (emulator->replay) {
+    count = replayChanges(emulator->replay, emulator->frame, changes,
+                          MAX_FRAME_CHANGES);
+  }
+  emulator->frame++;
+
+  // Run as many cycles as match the desired clock speed at a refresh rate of
+  // 60fps, as one batch, with each key change landing partway through it
+  runFrame(chip8, changes, count);
+
+  if (emulator->rewind) {
+    pushRewindFrame(emulator->rewind, chip8);
+  }
+}
+
+// Runs the cpu and timers at 60Hz on their own thread so a slow present or
+// compositor hiccup can't hold up emulation
+static int emulationThread(void *data) {
+  Emulator *emulator = data;
+  Chip8 *chip8 = emulator->chip8;
+
+  FrameScheduler scheduler;
+  startScheduler(&scheduler, true, frameStats);
+
+  while (SDL_AtomicGet(&emulator->running)) {
+    // Run however many frames are due, which is more than one if we have
+    // fallen behind
+    int frames = waitForFrames(&scheduler);
+
+    for (int i = 0; i < frames; i++) {
+      KeyChange changes[MAX_FRAME_CHANGES];
+      int count = takeKeyChanges(&emulator->input, &emulator->keys, &scheduler,
+                                 emulator->chip8->clockSpeed,
+                                 scheduler.frame - frames + i, changes);
+      bool rewinding = emulator->rewind && (emulator->keys & REWIND_KEY);
+
+      // The beeper follows the sound timer as it stands going into the frame
+      if (emulator->audio.device != 0) {
+        pushBeep(&emulator->audio, chip8->sound > 0 && !rewinding &&
+                                       chip8->trap.code == TRAP_NONE);
       }
-    }
-    break;
-  // FX65 - Load registers up to VX from successive memory locations
-  case 0x65:
-    for (int i = 0; i <= X; i++) {
-      chip8->V[i] = chip8->memory[initialIndex + i];
-      if (xFIndexQuirk) {
-        chip8->index++;
+
+      // Fast forwarding runs several emulated frames in the time of one, so
+      // the timers still count down once per emulated frame. Only the last
+      // one gets drawn, and key changes land in the first
+      int speed = emulator->keys & FAST_FORWARD_KEY ? fastForward : 1;
+      for (int step = 0; step < speed; step++) {
+        emulateFrame(emulator, changes, step == 0 ? count : 0);
       }
     }
-    break;
 
-  default:
-    unrecognisedOpcode(chip8->opcode);
-    break;
+    if (chip8->displayDirty) {
+      publishFrame(&emulator->frames, chip8->display, chip8->hires);
+      chip8->displayDirty = false;
+    }
   }
+  return 0;
 }
 
-void cpuCycle(Chip8 *chip8) {
-  // Fetch
-  chip8->opcode = chip8->memory[chip8->pc] << 8 | chip8->memory[chip8->pc + 1];
-  chip8->pc += 2;
+// Handle one event from the window, returning false if it asks to quit
+static bool handleEvent(Emulator *emulator, Uint32 *keys,
+                        const SDL_Event *event) {
+  if (event->type == SDL_QUIT) {
+    return false;
+  }
+  if ((event->type != SDL_KEYDOWN && event->type != SDL_KEYUP) ||
+      event->key.repeat) {
+    return true;
+  }
 
-  // Decode
-  uint8_t importantNibble = (chip8->opcode & 0xF000) >> 12;
+  Uint32 bit = keyBit(event->key.keysym.scancode);
+  Uint32 held = event->type == SDL_KEYDOWN ? *keys | bit : *keys & ~bit;
+  if (held == *keys) {
+    return true;
+  }
+  *keys = held;
 
-  // Execute
-  void (*ops[0x10])(Chip8 *) = {
-      x0, x1, x2, x3, //
-      x4, x5, x6, x7, //
-      x8, x9, xA, xB, //
-      xC, xD, xE, xF, //
-  };
+  // Events are stamped in milliseconds on a different clock, so work out how
+  // long ago this one was to place it on the performance counter
+  Uint64 now = SDL_GetPerformanceCounter();
+  Uint32 age = SDL_GetTicks() - event->key.timestamp;
+  Uint64 ago = (Uint64)age * SDL_GetPerformanceFrequency() / 1000;
+  pushKeyEvent(&emulator->input, (KeyEvent){ago < now ? now - ago : 0, held});
+  return true;
+}
 
-  ops[importantNibble](chip8);
+// Drain every pending event, returning false if one of them asks to quit
+static bool handleEvents(Emulator *emulator, Uint32 *keys) {
+  bool running = true;
+  SDL_Event event;
+
+  while (SDL_PollEvent(&event)) {
+    running &= handleEvent(emulator, keys, &event);
+  }
+  return running;
 }
 
-const int keymap[16] = {
-    SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3, SDL_SCANCODE_4,
-    SDL_SCANCODE_Q, SDL_SCANCODE_W, SDL_SCANCODE_E, SDL_SCANCODE_R,
-    SDL_SCANCODE_A, SDL_SCANCODE_S, SDL_SCANCODE_D, SDL_SCANCODE_F,
-    SDL_SCANCODE_Z, SDL_SCANCODE_X, SDL_SCANCODE_C, SDL_SCANCODE_V};
+// Without vsync, block on input until shortly before the next frame is due
+// so key presses are stamped as they arrive rather than once a frame
+static bool waitForInput(Emulator *emulator, Uint32 *keys,
+                         const FrameScheduler *scheduler) {
+  Uint64 deadline = frameDeadline(scheduler, scheduler->frame);
+  bool running = true;
 
-void checkKeyboard(Chip8 *chip8) {
-  SDL_PumpEvents();
-  const uint8_t *keyboard = SDL_GetKeyboardState(NULL);
+  for (;;) {
+    Uint64 now = SDL_GetPerformanceCounter();
+    Uint64 remainingMS =
+        now < deadline ? (deadline - now) * 1000 / scheduler->frequency : 0;
+    SDL_Event event;
 
-  for (int i = 0; i < 0x10; i++) {
-    chip8->keypad[i] = keyboard[keymap[i]];
+    // Leave the last couple of milliseconds to the scheduler's spin
+    if (remainingMS <= 2 || !SDL_WaitEventTimeout(&event, remainingMS - 2)) {
+      return running;
+    }
+    running &= handleEvent(emulator, keys, &event);
   }
 }
 
-void loop(Chip8 *chip8) {
+void loop(Chip8 *chip8, Recording *recording, Replay *replay) {
   bool running = true;
-  SDL_Event event;
+  Uint32 keys = 0;           // Keys held according to the events seen so far
+  bool hires = chip8->hires; // Resolution of the last frame drawn
 
-  SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(
-      SDL_SWSURFACE, 64, 32, 1, SDL_PIXELFORMAT_INDEX8);
-  SDL_Color colors[2] = {background, foreground};
-  SDL_SetPaletteColors(surface->format->palette, colors, 0, 2);
+  // Create the texture once and stream the display into it each frame
+  SDL_Texture *texture = NULL;
+  ShaderRenderer shader;
+  if (useShader) {
+    startShaderRenderer(&shader);
+  } else {
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+                                SDL_TEXTUREACCESS_STREAMING, 128, 64);
+    if (!texture) {
+      printf("Error : %s", SDL_GetError());
+      quitSDL();
+      exit(EXIT_FAILURE);
+    }
+  }
 
-  while (running) {
+  // Start from the initial display until the first frame is published
+  if (useShader) {
+    drawShader(&shader, chip8->display, hires);
+  } else {
+    draw(texture, chip8->display, hires);
+  }
 
-    Uint64 start = SDL_GetPerformanceCounter();
+  Emulator emulator = {.chip8 = chip8,
+                       .recording = recording,
+                       .replay = replay,
+                       .frames = {.back = 0, .front = 1}};
+  if (rewindEnabled) {
+    emulator.rewind = malloc(sizeof(Rewind));
+    if (emulator.rewind == NULL) {
+      fprintf(stderr, "Could not allocate the rewind buffer\n");
+      quitSDL();
+      exit(EXIT_FAILURE);
+    }
+    startRewind(emulator.rewind, chip8);
+  }
+  SDL_AtomicSet(&emulator.frames.spare, 2);
+  SDL_AtomicSet(&emulator.input.head, 0);
+  SDL_AtomicSet(&emulator.input.tail, 0);
+  SDL_AtomicSet(&emulator.running, 1);
+  if (!muted) {
+    startAudio(&emulator.audio);
+  }
 
-    // Determine how many times to cycle the cpu in order to match the
-    // desired clock speed at a refresh rate of 60fps
-    for (int i = 0; i < (clockSpeed / 60); i++) {
-      cpuCycle(chip8);
+  SDL_Thread *thread =
+      SDL_CreateThread(emulationThread, "chip8-emulation", &emulator);
+  if (!thread) {
+    printf("Error : %s", SDL_GetError());
+    quitSDL();
+    exit(EXIT_FAILURE);
+  }
+
+  // With vsync the present paces the render thread, otherwise it waits for
+  // the next frame itself
+  FrameScheduler scheduler;
+  startScheduler(&scheduler, !vsync, false);
+
+  while (running && SDL_AtomicGet(&emulator.running)) {
+    if (!vsync) {
+      running &= waitForInput(&emulator, &keys, &scheduler);
+    }
+    waitForFrames(&scheduler);
+
+    running &= handleEvents(&emulator, &keys);
+
+    const uint64_t *display = consumeFrame(&emulator.frames, &hires);
+    if (useShader) {
+      drawShader(&shader, display, hires);
+    } else {
+      draw(texture, display, hires);
+    }
+  }
+
+  SDL_AtomicSet(&emulator.running, 0);
+  SDL_WaitThread(thread, NULL);
+  stopAudio(&emulator.audio);
+  free(emulator.rewind);
+  if (recording) {
+    stopRecording(recording, emulator.frame);
+  }
+
+  if (useShader) {
+    stopShaderRenderer(&shader);
+  } else {
+    SDL_DestroyTexture(texture);
+    texture = NULL;
+  }
+}
+
+// Streams a session over a pipe or socket, stdout and stdin, for showing it
+// somewhere else such as a browser. Every message to the client starts with
+// a type byte:
+//   'D' A display update. A flags byte, bit 0 set at high resolution and
+//       bit 1 while the sound timer runs, then a varint frame number. Then
+//       the XOR of the display words with the last update, as their bytes
+//       from the top of each word, run length encoded as pairs of varints:
+//       zero bytes to skip, then a count of literal bytes that follow. Pairs
+//       carry on until all DISPLAY_WORDS * 8 bytes are covered
+//   'E' The session ended. A byte with the TrapCode it stopped on
+// and the client sends keypad changes back:
+//   'K' The keys now held, as a bitmask in two bytes, low byte first
+// Closing the input ends the session
+typedef struct Stream {
+  FILE *out;
+  FILE *in;
+  uint64_t sent[DISPLAY_WORDS]; // Display as of the last update
+  bool sounding;                // Sound flag of the last update
+  KeyQueue input;
+  SDL_atomic_t running; // Cleared when the client goes away
+} Stream;
+
+// Blocks reading the client's messages, stamping each change as it arrives
+static int streamInputThread(void *data) {
+  Stream *stream = data;
+  uint8_t message[3];
+
+  while (fread(message, 1, 1, stream->in) == 1 && message[0] == 'K' &&
+         fread(&message[1], 2, 1, stream->in) == 1) {
+    KeyEvent event = {SDL_GetPerformanceCounter(),
+                      message[1] | message[2] << 8};
+    pushKeyEvent(&stream->input, event);
+  }
+  SDL_AtomicSet(&stream->running, 0);
+  return 0;
+}
+
+// Send what changed on the display since the last update. Rows that didn't
+// change XOR to zero and cost next to nothing, so mostly still frames are a
+// handful of bytes
+static void sendFrame(Stream *stream, const Chip8 *chip8, long frame) {
+  uint8_t diff[DISPLAY_WORDS * 8];
+  for (int i = 0; i < DISPLAY_WORDS; i++) {
+    uint64_t change = chip8->display[i] ^ stream->sent[i];
+    for (int b = 0; b < 8; b++) {
+      diff[i * 8 + b] = change >> (56 - b * 8);
     }
+    stream->sent[i] = chip8->display[i];
+  }
+  stream->sounding = chip8->sound > 0;
 
-    if (chip8->delay > 0) {
-      chip8->delay--;
+  fputc('D', stream->out);
+  fputc(chip8->hires | stream->sounding << 1, stream->out);
+  putVarint(stream->out, frame);
+  for (size_t position = 0; position < sizeof(diff);) {
+    size_t zeros = 0;
+    while (position + zeros < sizeof(diff) && diff[position + zeros] == 0) {
+      zeros++;
     }
+    position += zeros;
 
-    if (chip8->sound > 0) {
-      chip8->sound--;
+    // A lone zero is cheaper to send as a literal than to start a new pair
+    size_t literals = 0;
+    while (position + literals < sizeof(diff) &&
+           (diff[position + literals] != 0 ||
+            (position + literals + 1 < sizeof(diff) &&
+             diff[position + literals + 1] != 0))) {
+      literals++;
     }
+    putVarint(stream->out, zeros);
+    putVarint(stream->out, literals);
+    fwrite(&diff[position], 1, literals, stream->out);
+    position += literals;
+  }
+}
+
+// Run a session in real time with no window, streaming the display to the
+// client and taking its keypad input
+void runStream(Chip8 *chip8, Recording *recording, Replay *replay) {
+  static Stream stream;
+  stream.out = stdout;
+  stream.in = stdin;
+  SDL_AtomicSet(&stream.input.head, 0);
+  SDL_AtomicSet(&stream.input.tail, 0);
+  SDL_AtomicSet(&stream.running, 1);
+
+  SDL_Thread *thread =
+      SDL_CreateThread(streamInputThread, "chip8-input", &stream);
+  if (!thread) {
+    fprintf(stderr, "Error : %s\n", SDL_GetError());
+    exit(EXIT_FAILURE);
+  }
+  // It stays blocked reading until the client goes, which can be after
+  // the session has ended
+  SDL_DetachThread(thread);
+
+  FrameScheduler scheduler;
+  startScheduler(&scheduler, true, frameStats);
+  Uint32 keys = 0;
+  long frame = 0;
 
-    checkKeyboard(chip8);
+  sendFrame(&stream, chip8, frame);
+  fflush(stream.out);
+  while (SDL_AtomicGet(&stream.running) && chip8->trap.code == TRAP_NONE) {
+    int frames = waitForFrames(&scheduler);
 
-    draw(chip8, surface);
+    for (int i = 0; i < frames && chip8->trap.code == TRAP_NONE; i++) {
+      KeyChange changes[MAX_FRAME_CHANGES];
+      int count = takeKeyChanges(&stream.input, &keys, &scheduler,
+                                 chip8->clockSpeed,
+                                 scheduler.frame - frames + i, changes);
 
-    SDL_PollEvent(&event);
-    if (event.type == SDL_QUIT) {
-      running = false;
+      if (recording) {
+        for (int j = 0; j < count; j++) {
+          recordKeys(recording, frame, &changes[j]);
+        }
+      }
+      if (replay) {
+        count = replayChanges(replay, frame, changes, MAX_FRAME_CHANGES);
+      }
+      frame++;
+      runFrame(chip8, changes, count);
     }
 
-    Uint64 end = SDL_GetPerformanceCounter();
-    float elapsed = (end - start) / (float)SDL_GetPerformanceFrequency();
-    float elapsedMS = elapsed * 1000.0f;
-    // Wait until it's time for the next frame
-    SDL_Delay(floor(16.666f - elapsedMS));
+    if (chip8->displayDirty || (chip8->sound > 0) != stream.sounding) {
+      sendFrame(&stream, chip8, frame);
+      chip8->displayDirty = false;
+      if (fflush(stream.out) != 0) {
+        break;
+      }
+    }
   }
 
-  SDL_FreeSurface(surface);
-  surface = NULL;
+  fputc('E', stream.out);
+  fputc(chip8->trap.code, stream.out);
+  fflush(stream.out);
+  if (recording) {
+    stopRecording(recording, frame);
+  }
 }
 
-static void handleOptions(int argc, char *const *argv, char **filePath) {
+static void handleOptions(int argc, char *const *argv, char *const **filePaths,
+                          int *fileCount) {
   static struct option long_options[] = {
       {"scale", required_argument, NULL, 's'},
       {"clock", required_argument, NULL, 'c'},
+      {"headless", no_argument, NULL, 'H'},
+      {"frames", required_argument, NULL, 'f'},
+      {"cycles", required_argument, NULL, 'n'},
+      {"block-cache", no_argument, NULL, 'b'},
+      {"jobs", required_argument, NULL, 'j'},
+      {"lanes", no_argument, NULL, 'l'},
+      {"vsync", no_argument, NULL, 'V'},
+      {"frame-stats", no_argument, NULL, 'S'},
+      {"bench", no_argument, NULL, 'B'},
+      {"load-state", required_argument, NULL, 'L'},
+      {"save-state", required_argument, NULL, 'W'},
+      {"rewind", no_argument, NULL, 'R'},
+      {"record", required_argument, NULL, 'r'},
+      {"replay", required_argument, NULL, 'p'},
+      {"seed", required_argument, NULL, 'e'},
+      {"pack", required_argument, NULL, 'P'},
+      {"corpus", required_argument, NULL, 'C'},
+      {"quirks", required_argument, NULL, 'q'},
+      {"mute", no_argument, NULL, 'm'},
+      {"shader", no_argument, NULL, 'g'},
+      {"persistence", required_argument, NULL, 't'},
+      {"fast-forward", required_argument, NULL, 'F'},
+      {"stream", no_argument, NULL, 'O'},
+      {"debug", no_argument, NULL, 'D'},
+      {"analyze", no_argument, NULL, 'A'},
+      {"compile", required_argument, NULL, 'T'},
+      {"conformance", no_argument, NULL, 'K'},
       {NULL, 0, NULL, 0}};
 
   int c;
-  while ((c = getopt_long(argc, argv, "s:c:", long_options, NULL)) != -1) {
+  while ((c = getopt_long(argc, argv,
+                          "s:c:Hf:n:bj:lVSBL:W:Rr:p:e:P:C:q:mgt:F:ODAT:K",
+                          long_options, NULL)) != -1) {
     switch (c) {
     case 's':
       if (atoi(optarg) != 0) {
@@ -585,16 +5111,138 @@ static void handleOptions(int argc, char *const *argv, char **filePath) {
       break;
     case 'c':
       if (atoi(optarg) >= 60) {
-        clockSpeed = atoi(optarg);
+        settings.clockSpeed = atoi(optarg);
       } else if (atoi(optarg) > 0 && atoi(optarg) < 60) {
         // If clockspeed is less than 60 manually set it so that
         // at least one cycle happens per frame
-        clockSpeed = 60;
+        settings.clockSpeed = 60;
       } else {
         fprintf(stderr, "Clock must be a non-zero integer\n");
         exit(EXIT_FAILURE);
       }
       break;
+    case 'H':
+      headless = true;
+      break;
+    case 'b':
+      settings.blockCache = true;
+      break;
+    case 'l':
+      useLanes = true;
+      break;
+    case 'V':
+      vsync = true;
+      break;
+    case 'S':
+      frameStats = true;
+      break;
+    case 'B':
+      bench = true;
+      break;
+    case 'P':
+      packPath = optarg;
+      break;
+    case 'C':
+      corpusPath = optarg;
+      break;
+    case 'q':
+      settings.quirkProfile = findQuirkProfile(optarg);
+      if (settings.quirkProfile < 0) {
+        fprintf(stderr, "Quirks must be one of");
+        for (size_t i = 0; i < QUIRK_PROFILE_COUNT; i++) {
+          fprintf(stderr, " %s", quirkProfiles[i].name);
+        }
+        fprintf(stderr, "\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'L':
+      loadStatePath = optarg;
+      break;
+    case 'W':
+      saveStatePath = optarg;
+      break;
+    case 'R':
+      rewindEnabled = true;
+      break;
+    case 'm':
+      muted = true;
+      break;
+    case 'g':
+      useShader = true;
+      break;
+    case 'O':
+      streaming = true;
+      break;
+    case 'D':
+      debugging = true;
+      break;
+    case 'A':
+      analyzing = true;
+      break;
+    case 'T':
+      compilePath = optarg;
+      break;
+    case 'K':
+      conformance = true;
+      break;
+    case 'F':
+      // How many frames holding tab runs in the time of one
+      if (atoi(optarg) > 0) {
+        fastForward = atoi(optarg);
+      } else {
+        fprintf(stderr, "Fast forward speed must be a positive integer\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 't':
+      // How much of a phosphor's brightness is left a frame after it turns off
+      persistence = atof(optarg);
+      if (persistence < 0 || persistence >= 1) {
+        fprintf(stderr, "Persistence must be at least 0 and less than 1\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'r':
+      recordPath = optarg;
+      break;
+    case 'p':
+      replayPath = optarg;
+      break;
+    case 'e': {
+      char *end;
+      unsigned long value = strtoul(optarg, &end, 0);
+      if (*optarg == '\0' || *end != '\0' || value > UINT32_MAX) {
+        fprintf(stderr, "Seed must be an unsigned 32 bit integer\n");
+        exit(EXIT_FAILURE);
+      }
+      settings.seed = value;
+      break;
+    }
+    case 'j':
+      if (atoi(optarg) > 0) {
+        jobCount = atoi(optarg);
+      } else {
+        fprintf(stderr, "Jobs must be a non-zero integer\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'f':
+      if (atol(optarg) > 0) {
+        frameBudget = atol(optarg);
+      } else {
+        fprintf(stderr, "Frames must be a non-zero integer\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'n':
+      if (atol(optarg) > 0) {
+        cycleBudget = atol(optarg);
+      } else {
+        fprintf(stderr, "Cycles must be a non-zero integer\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
     case '?':
     default:
       exit(EXIT_FAILURE);
@@ -602,29 +5250,158 @@ static void handleOptions(int argc, char *const *argv, char **filePath) {
     }
   }
 
-  // Get input file-path
+  // Stepping backwards would make the log disagree with what was played
+  if (rewindEnabled && (recordPath || replayPath)) {
+    fprintf(stderr, "Rewind can't be used while recording or replaying\n");
+    exit(EXIT_FAILURE);
+  }
+  if (recordPath && headless) {
+    fprintf(stderr, "There is no input to record when running headless\n");
+    exit(EXIT_FAILURE);
+  }
+  if (debugging && streaming) {
+    fprintf(stderr, "The debugger and the stream both need stdin\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Get input file-paths, benchmarks and corpora bring their own programs
   if (optind < argc) {
-    *filePath = argv[optind];
+    *filePaths = &argv[optind];
+    *fileCount = argc - optind;
+  } else if (bench || corpusPath || conformance) {
+    *filePaths = NULL;
+    *fileCount = 0;
   } else {
     fprintf(stderr, "You must specify the path to the ROM you wish to load\n");
     exit(EXIT_FAILURE);
   }
+
+  // Several ROMs or --jobs make a headless batch, which none of these run in
+  bool batch = !bench && !packPath && !corpusPath && !conformance &&
+               (*fileCount > 1 || jobCount > 0);
+  if (batch && (analyzing || compilePath || debugging || streaming)) {
+    fprintf(stderr, "--analyze, --compile, --debug and --stream only take a "
+                    "single ROM and can't be used with --jobs\n");
+    exit(EXIT_FAILURE);
+  }
 }
 
 int main(int argc, char *const argv[]) {
 
-  char *filePath;
+  char *const *filePaths;
+  int fileCount;
+
+  handleOptions(argc, argv, &filePaths, &fileCount);
+
+  if (bench) {
+    runBenchmarks();
+    return EXIT_SUCCESS;
+  }
+
+  if (packPath) {
+    writePack(packPath, filePaths, fileCount);
+    return EXIT_SUCCESS;
+  }
+
+  if (corpusPath) {
+    runCorpus(corpusPath);
+    return EXIT_SUCCESS;
+  }
+
+  if (conformance) {
+    runConformance(filePaths, fileCount);
+    return EXIT_SUCCESS;
+  }
 
-  handleOptions(argc, argv, &filePath);
+  // Several ROMs, or asking for workers, runs them all headless as a batch
+  if (fileCount > 1 || jobCount > 0) {
+    runBatch(filePaths, fileCount);
+    return EXIT_SUCCESS;
+  }
 
   Chip8 chip8;
-  setupCHIP(&chip8);
-  loadROM(filePath, &chip8);
+  setupCHIP(&chip8, &settings);
+  const char *error = loadROM(filePaths[0], &chip8);
+  if (error) {
+    fprintf(stderr, "%s %s\n", filePaths[0], error);
+    return EXIT_FAILURE;
+  }
+
+  if (analyzing) {
+    return analyzeROM(&chip8) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  if (compilePath) {
+    compileROM(&chip8, filePaths[0], compilePath);
+    return EXIT_SUCCESS;
+  }
+
+  // Snapshots only store what has changed since the ROM was loaded
+  BaseImage base;
+  uint8_t state[MAX_SNAPSHOT_SIZE];
+  captureBase(&base, &chip8);
+
+  if (loadStatePath) {
+    size_t length = readStateFile(loadStatePath, state);
+    if (!loadState(&chip8, &base, state, length)) {
+      fprintf(stderr, "%s is not a snapshot of this ROM\n", loadStatePath);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (useLanes) {
+    runLanesHeadless(&chip8);
+    return EXIT_SUCCESS;
+  }
+
+  if (debugging) {
+    runDebugger(&chip8);
+    return EXIT_SUCCESS;
+  }
+
+  // Recording starts after any snapshot is loaded, so a replay needs the
+  // same snapshot
+  Recording recording;
+  Replay replay;
+  if (recordPath) {
+    startRecording(&recording, recordPath, &chip8);
+  }
+  if (replayPath) {
+    startReplay(&replay, replayPath, &chip8);
+  }
 
-  initializeSDL();
-  loop(&chip8);
-  quitSDL();
+  if (headless) {
+    char report[REPORT_SIZE];
+    runHeadless(&chip8, replayPath ? &replay : NULL, report, sizeof(report));
+    fputs(report, stdout);
+    if (saveStatePath) {
+      writeStateFile(saveStatePath, state, saveState(&chip8, &base, state));
+    }
+#ifdef CHIP8_PROFILE
+    printProfile(&chip8);
+#endif
+    return chip8.trap.code == TRAP_NONE ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (streaming) {
+    runStream(&chip8, recordPath ? &recording : NULL,
+              replayPath ? &replay : NULL);
+  } else {
+    initializeSDL();
+    loop(&chip8, recordPath ? &recording : NULL, replayPath ? &replay : NULL);
+    quitSDL();
+  }
+  if (saveStatePath) {
+    writeStateFile(saveStatePath, state, saveState(&chip8, &base, state));
+  }
+#ifdef CHIP8_PROFILE
+  printProfile(&chip8);
+#endif
 
+  if (chip8.trap.code != TRAP_NONE) {
+    fprintf(stderr, "Stopped on %s 0x%04x at 0x%04x\n",
+            trapNames[chip8.trap.code], chip8.trap.opcode, chip8.trap.pc);
+    return EXIT_FAILURE;
+  }
   return EXIT_SUCCESS;
 }
 